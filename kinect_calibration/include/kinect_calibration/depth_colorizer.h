@@ -0,0 +1,75 @@
+/*********************************************************************
+* Software License Agreement (BSD License)
+*
+*  Copyright (c) 2009, Willow Garage, Inc.
+*  All rights reserved.
+*
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions
+*  are met:
+*
+*   * Redistributions of source code must retain the above copyright
+*     notice, this list of conditions and the following disclaimer.
+*   * Redistributions in binary form must reproduce the above
+*     copyright notice, this list of conditions and the following
+*     disclaimer in the documentation and/or other materials provided
+*     with the distribution.
+*   * Neither the name of the Willow Garage nor the names of its
+*     contributors may be used to endorse or promote products derived
+*     from this software without specific prior written permission.
+*
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+*  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+*  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+*  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+*  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+*  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+*  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+*  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+*  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+*  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+*  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+*  POSSIBILITY OF SUCH DAMAGE.
+*********************************************************************/
+
+
+#ifndef KINECT_CALIBRATION_DEPTH_COLORIZER_H
+#define KINECT_CALIBRATION_DEPTH_COLORIZER_H
+
+#include <stdint.h>
+
+namespace kinect_calibration
+{
+
+// Colors raw 11-bit Kinect shifts for display: white through red,
+// yellow, green, cyan and blue to black as they get further away, and
+// black where there is no reading (2047).  The 2048 colors are worked out
+// once, so coloring a frame is a table lookup per pixel, with AVX2
+// gathers when available.
+class DepthColorizer
+{
+public:
+  // byte order of the 3-byte pixels written; BGR is what OpenCV uses,
+  // RGB what GL_RGB textures take
+  enum Order { RGB, BGR };
+
+  DepthColorizer(Order order = BGR);
+
+  // n pixels of raw shifts to n 3-byte pixels
+  void colorize(const uint16_t *shift, uint8_t *out, int n) const;
+
+  inline void colorize(uint16_t shift, uint8_t *out) const
+  {
+    uint32_t c = palette_[shift & 2047];
+    out[0] = c;
+    out[1] = c >> 8;
+    out[2] = c >> 16;
+  }
+
+private:
+  uint32_t palette_[2048];      // the 3 color bytes in output order, low byte first
+};
+
+} // namespace kinect_calibration
+
+#endif
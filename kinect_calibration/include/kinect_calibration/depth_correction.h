@@ -0,0 +1,108 @@
+/*********************************************************************
+* Software License Agreement (BSD License)
+*
+*  Copyright (c) 2009, Willow Garage, Inc.
+*  All rights reserved.
+*
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions
+*  are met:
+*
+*   * Redistributions of source code must retain the above copyright
+*     notice, this list of conditions and the following disclaimer.
+*   * Redistributions in binary form must reproduce the above
+*     copyright notice, this list of conditions and the following
+*     disclaimer in the documentation and/or other materials provided
+*     with the distribution.
+*   * Neither the name of the Willow Garage nor the names of its
+*     contributors may be used to endorse or promote products derived
+*     from this software without specific prior written permission.
+*
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+*  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+*  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+*  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+*  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+*  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+*  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+*  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+*  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+*  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+*  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+*  POSSIBILITY OF SUCH DAMAGE.
+*********************************************************************/
+
+
+#ifndef KINECT_CALIBRATION_DEPTH_CORRECTION_H
+#define KINECT_CALIBRATION_DEPTH_CORRECTION_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace kinect_calibration
+{
+
+// A per-tile linear correction of Kinect depth, which calibrate fits
+// from every pixel of the chessboard when asked to (-d).  Applying it is
+// one multiply-add per pixel:
+//   z' = gain*z + offset
+// with gain and offset those of the tile the pixel is in.  The file only
+// holds the tiles; load() expands them to per-pixel tables.
+struct DepthCorrection
+{
+  int rows, cols;               // image size
+  int tile;                     // tile edge, pixels
+  int tile_rows, tile_cols;
+  std::vector<float> tile_gain, tile_offset;  // offset in m
+
+  // the identity correction
+  DepthCorrection(int rows = 480, int cols = 640, int tile = 16);
+
+  // reads/writes depth_correction.yaml; load() returns false, and prints
+  // why, if the file is missing or doesn't match the image size
+  bool load(const std::string &fname);
+  bool save(const std::string &fname) const;
+
+  // corrects metric depths (m) of a whole image in place; 0 (no reading)
+  // stays 0
+  void apply(float *depth) const;
+
+  // fills the per-pixel tables from the tiles
+  void expand();
+
+private:
+  std::vector<float> gain_, offset_;  // per pixel
+};
+
+// Fits a DepthCorrection by least squares, one sample at a time.  Each
+// tile only accumulates the sums of its normal equations, so any number
+// of pixels can be added without keeping them.
+class DepthCorrectionFit
+{
+public:
+  DepthCorrectionFit(int rows = 480, int cols = 640, int tile = 16);
+
+  // a pixel with measured depth z where the true depth is z_true (m)
+  void add(int u, int v, double z, double z_true);
+
+  // Solves every tile.  Tiles with fewer than min_samples are left at
+  // the identity, and the rest are pulled towards it with weight lambda
+  // (in samples), so a tile only seen at one distance stays sane.
+  // Returns the number of tiles fitted.
+  int solve(DepthCorrection &corr, int min_samples = 100, double lambda = 10.0) const;
+
+  // RMS error (m) of the samples with corr applied
+  double rms(const DepthCorrection &corr) const;
+
+  long samples() const;
+
+private:
+  int rows_, cols_, tile_, tile_rows_, tile_cols_;
+  // per tile: count, sum z, z^2, z_true, z*z_true, z_true^2
+  std::vector<double> n_, sz_, szz_, st_, szt_, stt_;
+};
+
+} // namespace kinect_calibration
+
+#endif
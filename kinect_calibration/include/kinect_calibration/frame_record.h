@@ -0,0 +1,214 @@
+/*********************************************************************
+* Software License Agreement (BSD License)
+*
+*  Copyright (c) 2009, Willow Garage, Inc.
+*  All rights reserved.
+*
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions
+*  are met:
+*
+*   * Redistributions of source code must retain the above copyright
+*     notice, this list of conditions and the following disclaimer.
+*   * Redistributions in binary form must reproduce the above
+*     copyright notice, this list of conditions and the following
+*     disclaimer in the documentation and/or other materials provided
+*     with the distribution.
+*   * Neither the name of the Willow Garage nor the names of its
+*     contributors may be used to endorse or promote products derived
+*     from this software without specific prior written permission.
+*
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+*  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+*  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+*  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+*  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+*  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+*  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+*  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+*  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+*  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+*  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+*  POSSIBILITY OF SUCH DAMAGE.
+*********************************************************************/
+
+
+#ifndef KINECT_CALIBRATION_FRAME_RECORD_H
+#define KINECT_CALIBRATION_FRAME_RECORD_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <deque>
+#include <string>
+#include <vector>
+
+namespace kinect_calibration
+{
+
+// Raw Kinect streams, as acquire_data gets them
+enum
+{
+  STREAM_DEPTH = 1,             // 640x480 11-bit shifts, uint16_t
+  STREAM_RGB   = 2,             // 640x480 RGB, 3 bytes
+  STREAM_IR    = 3              // 640x480 10-bit IR, uint16_t
+};
+
+// A recording is a file header and then one record per frame, each an
+// 8-byte aligned FrameRecordHeader followed by the raw frame.  From
+// version 2 the records come in chunks, each written in one go, and the
+// file ends with an index of all the frames, so a reader can go straight
+// to any frame without touching the rest of the file.  A recording that
+// was never closed has no index, and is read by walking the chunks.
+#define FRAME_FILE_MAGIC   0x4345524b // "KREC"
+#define FRAME_CHUNK_MAGIC  0x4b4e4843 // "CHNK"
+#define FRAME_RECORD_MAGIC 0x4d415246 // "FRAM"
+#define FRAME_INDEX_MAGIC  0x5844494b // "KIDX"
+#define FRAME_FILE_VERSION 2
+
+struct FrameFileHeader
+{
+  uint32_t magic;
+  uint32_t version;
+  uint32_t reserved[2];
+};
+
+struct FrameChunkHeader
+{
+  uint32_t magic;
+  uint32_t nframes;
+  uint64_t size;                // of the records that follow
+};
+
+struct FrameRecordHeader
+{
+  uint32_t magic;
+  uint32_t stream;              // STREAM_*
+  uint32_t timestamp;           // from the device
+  uint32_t size;                // of the frame, not counting padding
+  double host_time;             // seconds, when the frame got to us
+};
+
+// the index is one entry per frame, then the footer, at the very end
+struct FrameIndexEntry
+{
+  uint64_t offset;              // of the FrameRecordHeader
+  uint32_t stream;
+  uint32_t timestamp;
+  double host_time;
+  uint32_t size;
+  uint32_t reserved;
+};
+
+struct FrameIndexFooter
+{
+  uint32_t magic;
+  uint32_t nframes;
+  uint64_t offset;              // of the first FrameIndexEntry
+};
+
+// one frame of a recording
+struct FrameRecord
+{
+  int stream;
+  uint32_t timestamp;
+  double host_time;
+  uint32_t size;
+  const uint8_t *data;
+};
+
+// Writes a recording.  append() copies the frame into the current chunk
+// and returns; a writer thread writes out full chunks, so the caller
+// (a libfreenect callback) never waits for the disk.  If the disk falls
+// so far behind that all nchunks buffers are full, frames are dropped
+// rather than held up.  append() should only be called from one thread
+// at a time.
+class FrameRecordWriter
+{
+public:
+  FrameRecordWriter(size_t chunk_size = 8 << 20, int nchunks = 8);
+  ~FrameRecordWriter();
+
+  bool open(const std::string &fname);
+  // false if the frame was dropped
+  bool append(int stream, uint32_t timestamp, double host_time, const void *data, uint32_t size);
+  // writes out what's left, and the index
+  void close();
+
+  long frames() const { return frames_; }
+  long dropped() const { return dropped_; }
+  // whether a write failed; the recording is cut short there
+  bool failed() const { return failed_; }
+
+private:
+  struct Chunk
+  {
+    std::vector<uint8_t> data;  // FrameChunkHeader, then the records
+    size_t used;
+    uint32_t nframes;
+  };
+
+  static void *writer(void *arg);
+  void run();
+  void submit();
+  bool writeAll(const void *data, size_t size);
+
+  size_t chunk_size_;
+  int fd_;
+  pthread_t thread_;
+  pthread_mutex_t mutex_;
+  pthread_cond_t full_cond_;    // a chunk to write, or closing
+  std::vector<Chunk> chunks_;
+  std::deque<Chunk *> free_, full_;
+  Chunk *current_;
+  uint64_t file_pos_;           // where current_ will be written
+  std::vector<FrameIndexEntry> index_;
+  long frames_, dropped_;
+  volatile bool failed_;
+  bool closing_;
+
+  // owns the file and the writer thread
+  FrameRecordWriter(const FrameRecordWriter &);
+  FrameRecordWriter &operator=(const FrameRecordWriter &);
+};
+
+// Reads a recording by mapping it into memory; the frames point into the
+// mapping, so nothing is copied.  A record cut short (by a crash while
+// recording, say) ends the recording.  Records that aren't frameSize()
+// of their stream are skipped, so every frame is a whole one.
+class FrameRecording
+{
+public:
+  FrameRecording();
+  ~FrameRecording();
+
+  bool open(const std::string &fname);
+  void close();
+
+  size_t size() const { return frames_.size(); }
+  const FrameRecord &frame(size_t i) const { return frames_[i]; }
+  // the first frame at or after host_time
+  size_t find(double host_time) const;
+
+private:
+  bool readIndex();
+  void scan(size_t pos, size_t end);
+
+  uint8_t *map_;
+  size_t map_size_;
+  std::vector<FrameRecord> frames_;
+  int skipped_;                 // records of the wrong size
+
+  // owns the mapping
+  FrameRecording(const FrameRecording &);
+  FrameRecording &operator=(const FrameRecording &);
+};
+
+// seconds since the epoch, for host_time
+double hostTime();
+
+// the size of a frame of a stream, 0 if the stream is unknown
+uint32_t frameSize(int stream);
+
+} // namespace kinect_calibration
+
+#endif
@@ -0,0 +1,117 @@
+/*********************************************************************
+* Software License Agreement (BSD License)
+*
+*  Copyright (c) 2009, Willow Garage, Inc.
+*  All rights reserved.
+*
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions
+*  are met:
+*
+*   * Redistributions of source code must retain the above copyright
+*     notice, this list of conditions and the following disclaimer.
+*   * Redistributions in binary form must reproduce the above
+*     copyright notice, this list of conditions and the following
+*     disclaimer in the documentation and/or other materials provided
+*     with the distribution.
+*   * Neither the name of the Willow Garage nor the names of its
+*     contributors may be used to endorse or promote products derived
+*     from this software without specific prior written permission.
+*
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+*  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+*  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+*  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+*  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+*  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+*  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+*  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+*  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+*  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+*  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+*  POSSIBILITY OF SUCH DAMAGE.
+*********************************************************************/
+
+
+#ifndef KINECT_CALIBRATION_FRAME_SOURCE_H
+#define KINECT_CALIBRATION_FRAME_SOURCE_H
+
+#include <stdint.h>
+#include <kinect_calibration/frame_record.h>
+
+namespace kinect_calibration
+{
+
+typedef void (*FrameCallback)(int stream, const void *data, uint32_t timestamp, void *arg);
+
+// Where acquire_data gets its frames: a Kinect through libfreenect, or a
+// recording.  Frames go to the callback from process(), on whatever
+// thread calls it.  Like the Kinect, a source streams depth and one of
+// RGB and IR at a time.
+class FrameSource
+{
+public:
+  FrameSource() : cb_(NULL), cb_arg_(NULL) {}
+  virtual ~FrameSource() {}
+
+  void setCallback(FrameCallback cb, void *arg)
+  {
+    cb_ = cb;
+    cb_arg_ = arg;
+  }
+
+  // starts depth and video, which is STREAM_RGB or STREAM_IR
+  virtual bool start(int video) = 0;
+  // switches the video stream
+  virtual void setVideo(int video) = 0;
+  // delivers the frames that are due; returns false once there won't be
+  // any more
+  virtual bool process() = 0;
+  virtual void stop() = 0;
+
+  // device controls; recordings ignore them
+  virtual void setTilt(double degrees) {}
+  virtual void setLed(int led) {}
+
+protected:
+  void deliver(int stream, const void *data, uint32_t timestamp)
+  {
+    if (cb_)
+      cb_(stream, data, timestamp, cb_arg_);
+  }
+
+private:
+  FrameCallback cb_;
+  void *cb_arg_;
+};
+
+// Plays a recording back at rate times the recorded speed, or as fast
+// as the callback takes the frames if rate is 0.  Frames of the video
+// stream that isn't selected are skipped.
+class ReplaySource : public FrameSource
+{
+public:
+  ReplaySource(const FrameRecording &rec, double rate = 1.0, bool loop = false);
+
+  bool start(int video);
+  void setVideo(int video);
+  bool process();
+  void stop();
+
+  // frames delivered so far
+  long delivered() const { return delivered_; }
+
+private:
+  const FrameRecording &rec_;
+  double rate_;
+  bool loop_;
+  volatile int video_;
+  bool running_;
+  size_t next_;
+  double start_host_, start_rec_; // when the first frame was played, and recorded
+  long delivered_;
+};
+
+} // namespace kinect_calibration
+
+#endif
@@ -0,0 +1,112 @@
+/*********************************************************************
+* Software License Agreement (BSD License)
+*
+*  Copyright (c) 2009, Willow Garage, Inc.
+*  All rights reserved.
+*
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions
+*  are met:
+*
+*   * Redistributions of source code must retain the above copyright
+*     notice, this list of conditions and the following disclaimer.
+*   * Redistributions in binary form must reproduce the above
+*     copyright notice, this list of conditions and the following
+*     disclaimer in the documentation and/or other materials provided
+*     with the distribution.
+*   * Neither the name of the Willow Garage nor the names of its
+*     contributors may be used to endorse or promote products derived
+*     from this software without specific prior written permission.
+*
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+*  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+*  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+*  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+*  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+*  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+*  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+*  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+*  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+*  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+*  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+*  POSSIBILITY OF SUCH DAMAGE.
+*********************************************************************/
+
+
+#ifndef KINECT_CALIBRATION_IMAGE_WRITER_H
+#define KINECT_CALIBRATION_IMAGE_WRITER_H
+
+#include <pthread.h>
+#include <deque>
+#include <string>
+#include <vector>
+#include <opencv2/core/core.hpp>
+
+namespace kinect_calibration
+{
+
+// Writes images on background threads, so encoding them (PNG mostly)
+// doesn't hold up the caller.  write() queues the image and returns, and
+// only blocks while max_queue writes are already waiting.  The image data
+// is shared, not copied, and the queue keeps it alive until it is
+// written, so hand over a cv::Mat nobody will draw into afterwards.
+class ImageWriter
+{
+public:
+  // called on a writer thread once a group is written or given up on, or
+  // in writeGroup() itself if no writer thread could be started; the
+  // first nplaced of fnames are in place, all of them if it went well
+  typedef void (*DoneFn)(const std::vector<std::string> &fnames, size_t nplaced, void *arg);
+
+  // png_compression is 0-9; the low levels are several times faster
+  // than OpenCV's default for slightly bigger files
+  ImageWriter(int nthreads = 0, int max_queue = 16, int png_compression = 1);
+  // writes everything still queued
+  ~ImageWriter();
+
+  void write(const std::string &fname, const cv::Mat &img);
+
+  // Writes images that belong together, e.g. the RGB and depth images of
+  // one view: each goes to a temporary name first, and they are only
+  // renamed once all of them are written, so a failed write leaves none
+  // of them behind.  Only a failed rename can leave part of the group in
+  // place (renamed files are kept, as they replace any older ones); done
+  // is told how many.
+  void writeGroup(const std::vector<std::string> &fnames, const std::vector<cv::Mat> &imgs,
+                  DoneFn done = NULL, void *arg = NULL);
+
+  // waits until everything queued so far has been written
+  void flush();
+
+  // images that could not be written
+  int failed();
+
+  static void *worker(void *arg);
+
+private:
+  struct Job
+  {
+    std::vector<std::string> fnames;
+    std::vector<cv::Mat> imgs;
+    bool group;                 // through temporary names
+    DoneFn done;
+    void *arg;
+  };
+
+  void run();
+  void queue(const Job &job);
+  size_t writeJob(const Job &job);
+
+  std::deque<Job> queue_;
+  pthread_mutex_t mutex_;
+  pthread_cond_t work_;         // a job was queued, or we are stopping
+  pthread_cond_t done_;         // a job was taken or finished
+  std::vector<pthread_t> threads_;
+  std::vector<int> params_;     // for imwrite
+  int max_queue_, busy_, failed_;
+  bool stop_;
+};
+
+} // namespace kinect_calibration
+
+#endif
@@ -0,0 +1,79 @@
+/*********************************************************************
+* Software License Agreement (BSD License)
+*
+*  Copyright (c) 2009, Willow Garage, Inc.
+*  All rights reserved.
+*
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions
+*  are met:
+*
+*   * Redistributions of source code must retain the above copyright
+*     notice, this list of conditions and the following disclaimer.
+*   * Redistributions in binary form must reproduce the above
+*     copyright notice, this list of conditions and the following
+*     disclaimer in the documentation and/or other materials provided
+*     with the distribution.
+*   * Neither the name of the Willow Garage nor the names of its
+*     contributors may be used to endorse or promote products derived
+*     from this software without specific prior written permission.
+*
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+*  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+*  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+*  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+*  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+*  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+*  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+*  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+*  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+*  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+*  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+*  POSSIBILITY OF SUCH DAMAGE.
+*********************************************************************/
+
+
+#ifndef KINECT_CALIBRATION_KINECT_PARAMS_H
+#define KINECT_CALIBRATION_KINECT_PARAMS_H
+
+#include <string>
+#include <Eigen/Core>
+
+namespace kinect_calibration
+{
+
+// Everything calibrate finds out about a Kinect.  load() reads back the
+// files calibrate writes into the data directory:
+//   calibration_depth.yaml  depth camera intrinsics
+//   calibration_rgb.yaml    RGB camera intrinsics and distortion
+//   kinect_params.yaml      shift offset, baseline and depth->RGB pose
+struct KinectParams
+{
+  double depth_K[9], depth_D[5];  // depth camera matrix and distortion
+  double rgb_K[9], rgb_D[5];      // RGB camera matrix and distortion
+  double R[9], T[3];              // depth camera to RGB camera
+  double shift_offset;            // shift at infinite distance
+  double baseline;                // between projector and depth camera (m)
+
+  KinectParams();
+
+  // returns false, and prints which file, if anything is missing
+  bool load(const std::string &dir);
+
+  // The 3x4 transform from (u, v, disparity, 1) in the depth image to
+  // homogeneous (u, v, w) in the rectified RGB image, D = P*S*Q.
+  Eigen::Matrix<double,3,4> depthToRgb() const;
+};
+
+// Reads a camera file written by calibrate's writeCalibration.
+bool readCalibration(const std::string &fname, double K[9], double D[5]);
+
+// Helpers for the other calibration files: read a whole (small) text
+// file, and find "key:" in it and read n numbers after it, either a
+// plain value or a "[ a, b, ... ]" list.
+bool readFile(const std::string &fname, std::string &text);
+bool readValues(const std::string &text, const char *key, double *out, int n);
+
+} // namespace kinect_calibration
+
+#endif
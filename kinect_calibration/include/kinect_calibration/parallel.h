@@ -0,0 +1,104 @@
+/*********************************************************************
+* Software License Agreement (BSD License)
+*
+*  Copyright (c) 2009, Willow Garage, Inc.
+*  All rights reserved.
+*
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions
+*  are met:
+*
+*   * Redistributions of source code must retain the above copyright
+*     notice, this list of conditions and the following disclaimer.
+*   * Redistributions in binary form must reproduce the above
+*     copyright notice, this list of conditions and the following
+*     disclaimer in the documentation and/or other materials provided
+*     with the distribution.
+*   * Neither the name of the Willow Garage nor the names of its
+*     contributors may be used to endorse or promote products derived
+*     from this software without specific prior written permission.
+*
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+*  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+*  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+*  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+*  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+*  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+*  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+*  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+*  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+*  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+*  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+*  POSSIBILITY OF SUCH DAMAGE.
+*********************************************************************/
+
+#ifndef KINECT_CALIBRATION_PARALLEL_H
+#define KINECT_CALIBRATION_PARALLEL_H
+
+#include <pthread.h>
+#include <unistd.h>
+
+namespace kinect_calibration
+{
+
+// number of threads to use when the caller doesn't say
+inline int defaultThreads()
+{
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return n > 0 ? (int)n : 1;
+}
+
+struct ParallelForJob
+{
+  void (*fn)(int, void *);
+  void *arg;
+  int n;
+  int next;
+  pthread_mutex_t mutex;
+};
+
+inline void *parallelForWorker(void *p)
+{
+  ParallelForJob *job = (ParallelForJob *)p;
+  while (1)
+    {
+      pthread_mutex_lock(&job->mutex);
+      int i = job->next++;
+      pthread_mutex_unlock(&job->mutex);
+      if (i >= job->n) break;
+      job->fn(i, job->arg);
+    }
+  return NULL;
+}
+
+// Calls fn(i, arg) for every i in [0,n), on up to nthreads threads
+// (0 means one per core).  Indices are handed out one at a time, so a
+// slow index doesn't hold up the rest.  The calling thread does work
+// too, and the call returns when every index is done.
+inline void parallelFor(int n, void (*fn)(int, void *), void *arg, int nthreads = 0)
+{
+  if (nthreads <= 0) nthreads = defaultThreads();
+  if (nthreads > n) nthreads = n;
+
+  ParallelForJob job;
+  job.fn = fn;
+  job.arg = arg;
+  job.n = n;
+  job.next = 0;
+  pthread_mutex_init(&job.mutex, NULL);
+
+  pthread_t threads[64];
+  int nt = 0;
+  for (; nt < nthreads - 1 && nt < 64; nt++)
+    if (pthread_create(&threads[nt], NULL, parallelForWorker, &job))
+      break;                    // just use the threads we got
+  parallelForWorker(&job);
+  for (int i = 0; i < nt; i++)
+    pthread_join(threads[i], NULL);
+
+  pthread_mutex_destroy(&job.mutex);
+}
+
+} // namespace kinect_calibration
+
+#endif
@@ -0,0 +1,101 @@
+/*********************************************************************
+* Software License Agreement (BSD License)
+*
+*  Copyright (c) 2009, Willow Garage, Inc.
+*  All rights reserved.
+*
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions
+*  are met:
+*
+*   * Redistributions of source code must retain the above copyright
+*     notice, this list of conditions and the following disclaimer.
+*   * Redistributions in binary form must reproduce the above
+*     copyright notice, this list of conditions and the following
+*     disclaimer in the documentation and/or other materials provided
+*     with the distribution.
+*   * Neither the name of the Willow Garage nor the names of its
+*     contributors may be used to endorse or promote products derived
+*     from this software without specific prior written permission.
+*
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+*  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+*  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+*  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+*  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+*  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+*  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+*  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+*  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+*  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+*  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+*  POSSIBILITY OF SUCH DAMAGE.
+*********************************************************************/
+
+
+#ifndef KINECT_CALIBRATION_REGISTRATION_H
+#define KINECT_CALIBRATION_REGISTRATION_H
+
+#include <stdint.h>
+#include <vector>
+#include <Eigen/Core>
+#include <kinect_calibration/shift_lut.h>
+
+namespace kinect_calibration
+{
+
+// Maps raw Kinect depth frames into the RGB camera.
+//
+// D is the 3x4 transform computed by calibrate (D = P*S*Q).  It takes
+// (u, v, disparity, 1) in the depth image to homogeneous (u, v, w) in
+// the rectified RGB image.  The per-pixel work is done in float, a row
+// at a time: the row term of D is computed once per row, and each
+// pixel only adds its column and disparity terms.  Four pixels are done
+// at a time with SSE2 when it is available.
+class DepthRegistration
+{
+public:
+  DepthRegistration(const Eigen::Matrix<double,3,4>& D, const ShiftLUT &lut,
+                    int rows = 480, int cols = 640);
+
+  // Any of the outputs may be NULL.  All images are rows x cols.
+  //   depth      raw 11-bit shifts
+  //   rgb        rectified BGR image; only needed for rgb_mapped
+  //   reg_disp   disparity*16 in the RGB image, z-buffered so the nearest
+  //              point wins; 0 where nothing maps
+  //   reg_shift  raw shift of the point that won the z-buffer; 2047 where
+  //              nothing maps
+  //   rgb_mapped BGR pixels mapped into the depth image; black where there
+  //              is no valid depth
+  // The projection is done row-parallel, then the z-buffer is filled in
+  // bands of output rows, one band per task, so the result is the same
+  // as doing the pixels one at a time in raster order.
+  void registerDepth(const uint16_t *depth, const uint8_t *rgb,
+                     uint16_t *reg_disp, uint16_t *reg_shift, uint8_t *rgb_mapped,
+                     int nthreads = 0);
+
+  // one row of the projection, and one band of the z-buffer; these are
+  // the parallelFor bodies
+  void projectRow(int i);
+  void zbufferBand(int band);
+
+private:
+  int rows_, cols_;
+  float dcol_[3], drow_[3], ddisp_[3], doff_[3]; // columns of D
+  float disp_[2048];              // disparity for each shift, 0 if not valid
+  uint16_t disp16_[2048];         // disparity*16, rounded
+
+  // per-frame state
+  const uint16_t *depth_;
+  const uint8_t *rgb_;
+  uint16_t *reg_disp_, *reg_shift_;
+  uint8_t *rgb_mapped_;
+  std::vector<int> target_;       // RGB image index for each depth pixel, -1 if none
+  std::vector<int> vmin_, vmax_;  // range of RGB rows each depth row maps to
+  std::vector<uint16_t> zbuf_;    // z-buffer when the caller doesn't want reg_disp
+  int band_rows_;
+};
+
+} // namespace kinect_calibration
+
+#endif
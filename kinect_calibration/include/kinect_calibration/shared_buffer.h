@@ -0,0 +1,130 @@
+/*********************************************************************
+* Software License Agreement (BSD License)
+*
+*  Copyright (c) 2009, Willow Garage, Inc.
+*  All rights reserved.
+*
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions
+*  are met:
+*
+*   * Redistributions of source code must retain the above copyright
+*     notice, this list of conditions and the following disclaimer.
+*   * Redistributions in binary form must reproduce the above
+*     copyright notice, this list of conditions and the following
+*     disclaimer in the documentation and/or other materials provided
+*     with the distribution.
+*   * Neither the name of the Willow Garage nor the names of its
+*     contributors may be used to endorse or promote products derived
+*     from this software without specific prior written permission.
+*
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+*  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+*  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+*  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+*  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+*  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+*  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+*  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+*  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+*  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+*  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+*  POSSIBILITY OF SUCH DAMAGE.
+*********************************************************************/
+
+
+#ifndef KINECT_CALIBRATION_SHARED_BUFFER_H
+#define KINECT_CALIBRATION_SHARED_BUFFER_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <vector>
+
+namespace kinect_calibration
+{
+
+// Like TripleBuffer, but with several consumer threads reading the same
+// frame, so a frame that goes to several places is copied in only once.
+// There is a buffer for each reader to hold, one for the newest frame and
+// one for the producer to fill.  Neither side waits for the other while
+// it reads or writes; the lock only guards which buffer is which.
+class SharedBuffer
+{
+public:
+  SharedBuffer(size_t size, int nreaders)
+    : buf_(nreaders + 2), tag_(nreaders + 2, 0), held_(nreaders, -1), seen_(nreaders, 0),
+      back_(0), latest_(-1), published_(0)
+  {
+    for (size_t i = 0; i < buf_.size(); i++)
+      buf_[i] = (uint8_t *)calloc(size, 1);
+    pthread_mutex_init(&mutex_, NULL);
+  }
+
+  ~SharedBuffer()
+  {
+    for (size_t i = 0; i < buf_.size(); i++)
+      free(buf_[i]);
+    pthread_mutex_destroy(&mutex_);
+  }
+
+  // producer: fill this, then publish()
+  uint8_t *writeBuffer() { return buf_[back_]; }
+  // and say what's in it, e.g. which kind of frame
+  void setTag(int tag) { tag_[back_] = tag; }
+
+  // makes the frame the newest, and moves on to a buffer nobody holds
+  void publish()
+  {
+    pthread_mutex_lock(&mutex_);
+    latest_ = back_;
+    published_++;
+    for (back_ = 0; back_ < (int)buf_.size(); back_++)
+      if (back_ != latest_ && !held(back_))
+        break;
+    pthread_mutex_unlock(&mutex_);
+  }
+
+  // reader: takes the newest published frame, if there is one since its
+  // last update().  Returns false and keeps the current frame if not.
+  bool update(int reader)
+  {
+    pthread_mutex_lock(&mutex_);
+    bool fresh = seen_[reader] != published_;
+    if (fresh)
+      {
+        held_[reader] = latest_;
+        seen_[reader] = published_;
+      }
+    pthread_mutex_unlock(&mutex_);
+    return fresh;
+  }
+
+  // only valid once update() has returned true
+  const uint8_t *readBuffer(int reader) const { return buf_[held_[reader]]; }
+  int tag(int reader) const { return tag_[held_[reader]]; }
+
+private:
+  bool held(int i) const
+  {
+    for (size_t r = 0; r < held_.size(); r++)
+      if (held_[r] == i)
+        return true;
+    return false;
+  }
+
+  pthread_mutex_t mutex_;
+  std::vector<uint8_t *> buf_;
+  std::vector<int> tag_;
+  std::vector<int> held_;       // by each reader, -1 for none yet
+  std::vector<unsigned> seen_;  // published_ at each reader's last update()
+  int back_, latest_;
+  unsigned published_;
+
+  SharedBuffer(const SharedBuffer &);
+  SharedBuffer &operator=(const SharedBuffer &);
+};
+
+} // namespace kinect_calibration
+
+#endif
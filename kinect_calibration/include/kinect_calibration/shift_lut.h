@@ -0,0 +1,77 @@
+/*********************************************************************
+* Software License Agreement (BSD License)
+*
+*  Copyright (c) 2009, Willow Garage, Inc.
+*  All rights reserved.
+*
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions
+*  are met:
+*
+*   * Redistributions of source code must retain the above copyright
+*     notice, this list of conditions and the following disclaimer.
+*   * Redistributions in binary form must reproduce the above
+*     copyright notice, this list of conditions and the following
+*     disclaimer in the documentation and/or other materials provided
+*     with the distribution.
+*   * Neither the name of the Willow Garage nor the names of its
+*     contributors may be used to endorse or promote products derived
+*     from this software without specific prior written permission.
+*
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+*  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+*  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+*  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+*  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+*  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+*  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+*  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+*  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+*  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+*  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+*  POSSIBILITY OF SUCH DAMAGE.
+*********************************************************************/
+
+
+#ifndef KINECT_CALIBRATION_SHIFT_LUT_H
+#define KINECT_CALIBRATION_SHIFT_LUT_H
+
+#include <stdint.h>
+#include <string>
+
+// raw Kinect shift units per pixel of disparity
+#define SHIFT_SCALE 0.125
+
+namespace kinect_calibration
+{
+
+// Everything that depends only on a raw 11-bit Kinect shift, for all
+// 2048 shifts.  Build it once from the calibration, then look pixels up
+// instead of converting them.
+struct ShiftLUT
+{
+  double shift_offset;          // shift at infinite distance
+  float disparity[2048];        // SHIFT_SCALE*(shift_offset - shift), 0 if not valid
+  float depth[2048];            // metric depth (m), 0 if not valid
+  uint16_t depth_mm[2048];      // depth in mm, 0 if not valid
+  uint8_t valid[2048];          // 1 if the shift is a reading in front of the sensor
+
+  // depth needs the depth camera focal length (pixels) and the
+  // projector baseline (m); without them only disparity and valid are set
+  ShiftLUT(double shift_offset = 1090.0, double baseline = 0.0, double focal = 0.0);
+
+  // reads kinect_params.yaml and calibration_depth.yaml from dir
+  bool load(const std::string &dir);
+
+  // depth (m) for n raw shifts; uses AVX2 gathers when available
+  void toDepth(const uint16_t *shift, float *depth, int n) const;
+  // same, in mm
+  void toDepthMM(const uint16_t *shift, uint16_t *depth, int n) const;
+
+private:
+  void build(double shift_offset, double baseline, double focal);
+};
+
+} // namespace kinect_calibration
+
+#endif
@@ -0,0 +1,115 @@
+/*********************************************************************
+* Software License Agreement (BSD License)
+*
+*  Copyright (c) 2009, Willow Garage, Inc.
+*  All rights reserved.
+*
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions
+*  are met:
+*
+*   * Redistributions of source code must retain the above copyright
+*     notice, this list of conditions and the following disclaimer.
+*   * Redistributions in binary form must reproduce the above
+*     copyright notice, this list of conditions and the following
+*     disclaimer in the documentation and/or other materials provided
+*     with the distribution.
+*   * Neither the name of the Willow Garage nor the names of its
+*     contributors may be used to endorse or promote products derived
+*     from this software without specific prior written permission.
+*
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+*  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+*  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+*  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+*  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+*  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+*  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+*  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+*  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+*  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+*  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+*  POSSIBILITY OF SUCH DAMAGE.
+*********************************************************************/
+
+
+#ifndef KINECT_CALIBRATION_TRIPLE_BUFFER_H
+#define KINECT_CALIBRATION_TRIPLE_BUFFER_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+namespace kinect_calibration
+{
+
+// Hands the newest frame from one producer thread to one consumer thread
+// without locks or copies.  There are three buffers: the producer fills
+// the back one, the consumer reads the front one, and publish() and
+// update() swap them with the one in the middle, atomically.  Neither
+// side ever waits for the other; frames the consumer didn't get to are
+// just overwritten.
+class TripleBuffer
+{
+public:
+  TripleBuffer(size_t size) : back_(0), front_(1), middle_(2)
+  {
+    for (int i = 0; i < 3; i++)
+      {
+        buf_[i] = (uint8_t *)calloc(size, 1);
+        tag_[i] = 0;
+      }
+  }
+
+  ~TripleBuffer()
+  {
+    for (int i = 0; i < 3; i++)
+      free(buf_[i]);
+  }
+
+  // producer: fill this, then publish()
+  uint8_t *writeBuffer() { return buf_[back_]; }
+  // and say what's in it, e.g. which kind of frame
+  void setTag(int tag) { tag_[back_] = tag; }
+
+  void publish()
+  {
+    back_ = swapMiddle(back_ | NEW) & INDEX;
+  }
+
+  // consumer: takes the newest published frame, if there is one since
+  // the last update().  Returns false and keeps the current frame if not.
+  bool update()
+  {
+    if (!(middle_ & NEW))
+      return false;
+    front_ = swapMiddle(front_) & INDEX;
+    return true;
+  }
+
+  const uint8_t *readBuffer() const { return buf_[front_]; }
+  uint8_t *readBuffer() { return buf_[front_]; }
+  int tag() const { return tag_[front_]; }
+
+private:
+  enum { INDEX = 3, NEW = 4 };
+
+  // sets the middle to m, returns what it was; a full barrier, so the
+  // buffer contents are visible before the index is
+  int swapMiddle(int m)
+  {
+    int old;
+    do
+      old = middle_;
+    while (__sync_val_compare_and_swap(&middle_, old, m) != old);
+    return old;
+  }
+
+  uint8_t *buf_[3];
+  int tag_[3];
+  int back_, front_;            // only touched by the producer / consumer
+  volatile int middle_;         // index, plus NEW if the producer put it there
+};
+
+} // namespace kinect_calibration
+
+#endif
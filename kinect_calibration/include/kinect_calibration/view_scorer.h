@@ -0,0 +1,97 @@
+/*********************************************************************
+* Software License Agreement (BSD License)
+*
+*  Copyright (c) 2009, Willow Garage, Inc.
+*  All rights reserved.
+*
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions
+*  are met:
+*
+*   * Redistributions of source code must retain the above copyright
+*     notice, this list of conditions and the following disclaimer.
+*   * Redistributions in binary form must reproduce the above
+*     copyright notice, this list of conditions and the following
+*     disclaimer in the documentation and/or other materials provided
+*     with the distribution.
+*   * Neither the name of the Willow Garage nor the names of its
+*     contributors may be used to endorse or promote products derived
+*     from this software without specific prior written permission.
+*
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+*  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+*  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+*  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+*  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+*  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+*  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+*  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+*  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+*  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+*  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+*  POSSIBILITY OF SUCH DAMAGE.
+*********************************************************************/
+
+#ifndef KINECT_CALIBRATION_VIEW_SCORER_H
+#define KINECT_CALIBRATION_VIEW_SCORER_H
+
+#include <vector>
+#include <opencv2/core/core.hpp>
+
+namespace kinect_calibration
+{
+
+// Where a chessboard is relative to the camera, roughly: enough to tell
+// whether a view shows calibrate anything the saved ones don't.
+struct BoardView
+{
+  double center[2];             // image position of the board, over the image width
+  double normal[3];             // board normal, in the camera frame
+  double distance;              // to the board, in squares
+  double tilt;                  // between the normal and the optical axis, radians
+  std::vector<int> cells;       // coverage grid cells the board covers
+  double sharpness;             // see ViewScorer::sharpness(), 0 if not measured
+};
+
+// Scores chessboard views for acquire_data's auto-capture.  A view is
+// worth saving if it covers part of the image no saved view has, or if
+// its pose (tilt, distance, position) is far enough from every saved
+// one; novelty() is 1 or more for those.  The pose comes from the four
+// outer corners and a nominal focal length, in closed form, so scoring a
+// detected board costs next to nothing.
+class ViewScorer
+{
+public:
+  // pattern is inner corners per row and column, as for
+  // findChessboardCorners; focal is in pixels
+  ViewScorer(cv::Size pattern, cv::Size image, double focal,
+             int grid_cols = 8, int grid_rows = 6);
+
+  // fills in view from the detected corners; false if the pose is degenerate
+  bool measure(const std::vector<cv::Point2f> &corners, BoardView &view) const;
+
+  double novelty(const BoardView &view) const;
+
+  // Sharpness of the board in a grayscale image: the spread of the
+  // Laplacian over that of the image itself, across the board's bounding
+  // box.  Blur from motion or focus lowers it.
+  static double sharpness(const cv::Mat &gray, const std::vector<cv::Point2f> &corners);
+  // whether a sharpness is close enough to that of the views saved so far
+  bool sharpEnough(double sharpness) const;
+
+  void add(const BoardView &view);
+  size_t size() const { return views_.size(); }
+  // fraction of the grid cells covered by the saved views
+  double coverage() const;
+
+private:
+  cv::Size pattern_, image_;
+  double focal_;
+  int grid_cols_, grid_rows_;
+  std::vector<int> covered_;    // saved views covering each cell
+  std::vector<BoardView> views_;
+};
+
+} // namespace kinect_calibration
+
+#endif
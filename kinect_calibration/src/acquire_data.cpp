@@ -27,7 +27,9 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <signal.h>
 #include <unistd.h> // getopt
+#include <sys/stat.h> // mkdir
 #include <cstdlib>
 #include "libfreenect.h"
 
@@ -50,6 +52,13 @@
 #include <opencv2/highgui/highgui.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
 
+#include <kinect_calibration/depth_colorizer.h>
+#include <kinect_calibration/frame_source.h>
+#include <kinect_calibration/image_writer.h>
+#include <kinect_calibration/shared_buffer.h>
+#include <kinect_calibration/triple_buffer.h>
+#include <kinect_calibration/view_scorer.h>
+
 using namespace std;
 
 // image size
@@ -59,105 +68,307 @@ using namespace std;
 // checkerboard pattern
 cv::Size pattern_size;
 
+// the live preview looks for the board in an image this many times
+// smaller (1, 2 or 4)
+int preview_scale = 2;
+
+// video frames, as the detector tells them apart
+enum { FRAME_RGB = 1, FRAME_IR = 2 };
+// who reads the video frames
+enum { DETECTOR = 0, DISPLAY = 1, NREADERS = 2 };
+// what the keys and autosave ask the detector for
+enum { REQ_SAVE = 1, REQ_SEQUENCE = 2, REQ_BACK_RGB = 4, REQ_BACK_IR = 8 };
+
 // saving images
 char *fdir = NULL;
-int ir_num = 0;                 // individual frames
-int rgb_num = 0;
-int depth_num = 0;
 int s_num = 0;                  // number of frames saved
-bool saveIR = false;            // flags to trigger saving
-bool saveRGB = false;
-bool saveDepth = false;
+#define DEPTH_WAIT 0.5          // seconds an RGB save waits for a depth frame
 
-pthread_t freenect_thread;
-volatile int die = 0;
+// Auto-capture (-a) saves a view whenever the board holds still in a pose
+// that adds something to the views saved so far, RGB and IR separately.
+bool auto_capture = false;
 
-int window;
-int ir_mode = 0;
+// A capture sequence (-S, or 'v') saves the RGB, depth and IR images of
+// one board pose under one index: it grabs the video stream that's on,
+// switches to the other one and grabs that, then switches back.  The
+// images are only written once all are in.
+#define SEQ_TIMEOUT 3.0         // seconds without the board before giving up
+bool sync_sequence = false;
+
+// PNG encoding is done here, off the capture and detection threads
+kinect_calibration::ImageWriter *image_writer;
 
-pthread_mutex_t gl_backbuf_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_t capture_thread;
+volatile sig_atomic_t die = 0;
 
-uint8_t gl_depth_front[640 * 480 * 4];
-uint8_t gl_depth_back[640 * 480 * 4];
+int window;
+
+// Frames carry when they were taken: the device's timestamp, and the
+// host's clock when the frame got to us, which is what frames from
+// different Kinects can be matched up by.
+struct FrameStamp
+{
+  uint32_t timestamp;
+  double host_time;
+};
+
+// Chessboard detection runs on its own thread, so the libfreenect
+// callbacks never wait for it.  They copy each RGB or IR frame into
+// video_buf, once, and carry on; the detector and the display each take
+// the newest one from there.  The detector hands back where it found the
+// board through detect_results, which the display draws over the frame.
+#define MAX_CORNERS 1024
+struct BoardResult
+{
+  int kind;                     // FRAME_RGB or FRAME_IR
+  bool found;
+  int ncorners;
+  cv::Point2f corners[MAX_CORNERS];
+};
+
+// Everything that is kept per Kinect (or recording standing in for one).
+// Each has its own buffers, detector thread and output directory; only
+// the capture thread, the display and the image writer are shared.
+struct Device
+{
+  int id;                       // device number, or recording number
+  string dir;                   // where its images go
+  kinect_calibration::FrameSource *source;
+  kinect_calibration::FrameRecordWriter *recorder; // raw streams, with -o
+
+  // The depth preview goes to the display through a triple buffer, so
+  // the callbacks never wait for the display, nor it for them, and
+  // nothing is copied on the way.  The video preview is the frame itself,
+  // from video_buf.
+  kinect_calibration::TripleBuffer gl_depth_buf;
+  GLuint gl_depth_tex;
+  GLuint gl_rgb_tex;
+  vector<uint8_t> ir_preview;   // gamma-corrected IR, display thread only
+
+  // While an RGB save is pending, every depth frame is handed to the
+  // detector, tagged with save_gen, so it can save the newest one along
+  // with the RGB image once it sees the board.  A FrameStamp comes first.
+  kinect_calibration::TripleBuffer pair_depth;
+
+  // a FrameStamp and then the frame; an RGB frame is the biggest we send
+  kinect_calibration::SharedBuffer video_buf;
+  kinect_calibration::TripleBuffer detect_results;
+  pthread_t detect_thread;      // finds the chessboard
+  // To wake the detector up, and hand it requests; nobody holds it for
+  // long.  Saves are only ever started by the detector, so the numbering
+  // and the rest of the save state below have just the one writer.
+  pthread_mutex_t detect_mutex;
+  pthread_cond_t detect_cond;
+  bool detect_pending;
+  int requests;                 // REQ_* flags
+
+  int ir_num;                   // individual frames
+  int rgb_num;                  // RGB and depth are saved in pairs
+  volatile bool saveIR;         // flags to trigger saving
+  volatile bool saveRGB;
+  volatile int save_gen;        // counts RGB saves, to pair depth frames with them
+  double save_time;             // when the last RGB save was asked for
+  pthread_mutex_t log_mutex;    // for timestamps.txt, written by the writer threads
+
+  kinect_calibration::ViewScorer rgb_scorer;
+  kinect_calibration::ViewScorer ir_scorer;
+
+  // The video stream is only switched on the capture thread, between
+  // calls to process(); anyone else asks for it through video_request.
+  // How long the new stream takes to come up is measured there too.
+  int ir_mode;
+  volatile int video_request;
+  int video_current;
+  double switch_time;           // when the last switch was made
+  bool restart_pending;         // no frame from the new stream yet
+  volatile double restart_ms;   // the last restart
+  double restart_total_ms, restart_max_ms;
+  int restarts;
+
+  volatile bool seq_active;
+  int seq_first;                // FRAME_RGB or FRAME_IR, whichever was on
+  double seq_start;
+  vector<string> seq_names;     // detector thread only
+  vector<cv::Mat> seq_imgs;
+  vector<FrameStamp> seq_stamps;
+
+  // counts for the summary at the end
+  long depth_frames, video_frames, detections, boards_found;
+
+  Device (int id, const string &dir, kinect_calibration::FrameSource *source)
+    : id (id), dir (dir), source (source), recorder (NULL),
+      gl_depth_buf (COLS * ROWS * 3), gl_depth_tex (0), gl_rgb_tex (0),
+      ir_preview (COLS * ROWS),
+      pair_depth (sizeof (FrameStamp) + FREENECT_FRAME_PIX * 2),
+      video_buf (sizeof (FrameStamp) + FREENECT_RGB_SIZE, NREADERS),
+      detect_results (sizeof (BoardResult)),
+      detect_pending (false), requests (0), ir_num (0), rgb_num (0),
+      saveIR (false), saveRGB (false), save_gen (0), save_time (0),
+      // nominal focal lengths; close enough to tell poses apart
+      rgb_scorer (pattern_size, cv::Size (COLS, ROWS), 525.0),
+      ir_scorer (pattern_size, cv::Size (COLS, ROWS), 585.0),
+      ir_mode (0), video_request (kinect_calibration::STREAM_RGB),
+      video_current (kinect_calibration::STREAM_RGB), switch_time (0),
+      restart_pending (false), restart_ms (0), restart_total_ms (0), restart_max_ms (0),
+      restarts (0), seq_active (false), seq_first (FRAME_RGB), seq_start (0),
+      depth_frames (0), video_frames (0), detections (0), boards_found (0)
+  {
+    pthread_mutex_init (&detect_mutex, NULL);
+    pthread_cond_init (&detect_cond, NULL);
+    pthread_mutex_init (&log_mutex, NULL);
+  }
+};
 
-uint8_t gl_rgb_front[640 * 480 * 4];
-uint8_t gl_rgb_back[640 * 480 * 4];
+vector<Device *> devices;
+// the preview shows each device's depth and video side by side, in a grid
+int grid_cols = 1, grid_rows = 1;
 
-GLuint gl_depth_tex;
-GLuint gl_rgb_tex;
+void wakeDetector (Device *d);
+void postRequest (Device *d, int request);
+void drawVideo (Device *d, float x, float y, bool fresh);
 
 freenect_context *f_ctx;
-freenect_device *f_dev;
 int freenect_angle = 0;
 int freenect_angle_last = 0;
 int freenect_led;
 
-
-pthread_cond_t gl_frame_cond = PTHREAD_COND_INITIALIZER;
-int got_frames = 0;
-
 void
 DrawGLScene ()
 {
-  pthread_mutex_lock (&gl_backbuf_mutex);
-
-  while (got_frames < 2)
+  // only textures with a new frame are uploaded
+  bool any_new = false;
+  vector<char> new_depth (devices.size ()), new_rgb (devices.size ());
+  for (size_t i = 0; i < devices.size (); i++)
   {
-    pthread_cond_wait (&gl_frame_cond, &gl_backbuf_mutex);
+    new_depth[i] = devices[i]->gl_depth_buf.update ();
+    new_rgb[i] = devices[i]->video_buf.update (DISPLAY);
+    any_new = any_new || new_depth[i] || new_rgb[i];
+  }
+  if (!any_new)
+  {
+    usleep (2000);              // nothing new; don't spin the idle loop
+    return;
   }
-
-  memcpy (gl_depth_front, gl_depth_back, sizeof (gl_depth_back));
-  memcpy (gl_rgb_front, gl_rgb_back, sizeof (gl_rgb_back));
-  got_frames = 0;
-  pthread_mutex_unlock (&gl_backbuf_mutex);
 
   glClear (GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
   glLoadIdentity ();
 
   glEnable (GL_TEXTURE_2D);
 
-  glBindTexture (GL_TEXTURE_2D, gl_depth_tex);
-  glTexImage2D (GL_TEXTURE_2D, 0, 3, 640, 480, 0, GL_RGB, GL_UNSIGNED_BYTE, gl_depth_front);
+  for (size_t i = 0; i < devices.size (); i++)
+  {
+    Device *d = devices[i];
+    float x = (i % grid_cols) * 1280, y = (i / grid_cols) * 480;
+
+    glBindTexture (GL_TEXTURE_2D, d->gl_depth_tex);
+    if (new_depth[i])
+      glTexImage2D (GL_TEXTURE_2D, 0, 3, 640, 480, 0, GL_RGB, GL_UNSIGNED_BYTE, d->gl_depth_buf.readBuffer ());
+
+    glBegin (GL_TRIANGLE_FAN);
+    glColor4f (255.0f, 255.0f, 255.0f, 255.0f);
+    glTexCoord2f (0, 0);
+    glVertex3f (x, y, 0);
+    glTexCoord2f (1, 0);
+    glVertex3f (x + 640, y, 0);
+    glTexCoord2f (1, 1);
+    glVertex3f (x + 640, y + 480, 0);
+    glTexCoord2f (0, 1);
+    glVertex3f (x, y + 480, 0);
+    glEnd ();
+
+    drawVideo (d, x + 640, y, new_rgb[i]);
+  }
 
-  glBegin (GL_TRIANGLE_FAN);
-  glColor4f (255.0f, 255.0f, 255.0f, 255.0f);
-  glTexCoord2f (0, 0);
-  glVertex3f (0, 0, 0);
-  glTexCoord2f (1, 0);
-  glVertex3f (640, 0, 0);
-  glTexCoord2f (1, 1);
-  glVertex3f (640, 480, 0);
-  glTexCoord2f (0, 1);
-  glVertex3f (0, 480, 0);
-  glEnd ();
+  glutSwapBuffers ();
+}
 
-  glBindTexture (GL_TEXTURE_2D, gl_rgb_tex);
-  glTexImage2D (GL_TEXTURE_2D, 0, 3, 640, 480, 0, GL_RGB, GL_UNSIGNED_BYTE, gl_rgb_front);
 
-  glBegin (GL_TRIANGLE_FAN);
-  glColor4f (255.0f, 255.0f, 255.0f, 255.0f);
-  glTexCoord2f (0, 0);
-  glVertex3f (640, 0, 0);
-  glTexCoord2f (1, 0);
-  glVertex3f (1280, 0, 0);
-  glTexCoord2f (1, 1);
-  glVertex3f (1280, 480, 0);
-  glTexCoord2f (0, 1);
-  glVertex3f (640, 480, 0);
-  glEnd ();
 
-  glutSwapBuffers ();
+// The save triggers, on the detector thread only; the others post a
+// request instead.
+
+// saves the next RGB frame the board is seen in, with a depth frame
+// from after now
+void
+requestRGB (Device *d)
+{
+  d->save_time = kinect_calibration::hostTime ();
+  d->save_gen++;
+  d->saveRGB = true;
 }
 
+void
+startSequence (Device *d)
+{
+  if (d->seq_active)
+    return;
+  d->seq_first = d->ir_mode ? FRAME_IR : FRAME_RGB;
+  d->seq_start = kinect_calibration::hostTime ();
+  d->seq_active = true;
+  if (d->ir_mode) d->saveIR = true;
+  else requestRGB (d);
+}
+
+// saves the next frames the board is seen in, of whichever stream is on,
+// or of both in sequence mode
+void
+triggerSave (Device *d)
+{
+  if (sync_sequence)
+    {
+      startSequence (d);
+      return;
+    }
+  if (d->ir_mode) d->saveIR = true;
+  else requestRGB (d);
+}
 
+void
+stopRecording (Device *d)
+{
+  if (!d->recorder)
+    return;
+  d->recorder->close ();
+  printf ("Device %d: recorded %ld frames, dropped %ld%s\n", d->id,
+          d->recorder->frames (), d->recorder->dropped (),
+          d->recorder->failed () ? "; the disk write failed, the recording is cut short" : "");
+  delete d->recorder;
+  d->recorder = NULL;
+}
 
+// in headless mode, Ctrl-C (or a kill) stops capture, and then
+// everything is shut down as if the recording had ended
+void
+stopCapture (int sig)
+{
+  die = 1;
+}
+
+// stops the detectors and finishes the saves, once capture has stopped
+void
+shutDown ()
+{
+  die = 1;
+  for (size_t i = 0; i < devices.size (); i++)
+    wakeDetector (devices[i]);
+  for (size_t i = 0; i < devices.size (); i++)
+  {
+    pthread_join (devices[i]->detect_thread, NULL);
+    stopRecording (devices[i]);
+  }
+  delete image_writer;          // finishes writing what was saved
+  image_writer = NULL;
+}
+
+// Keys act on every device at once, so one 's' takes a view from each.
 void
 keyPressed (unsigned char key, int x, int y)
 {
   if (key == 27)
   {
     die = 1;
-    pthread_join (freenect_thread, NULL);
+    pthread_join (capture_thread, NULL);
+    shutDown ();
     glutDestroyWindow (window);
     pthread_exit (NULL);
   }
@@ -181,71 +392,61 @@ keyPressed (unsigned char key, int x, int y)
       freenect_angle = -30;
     }
   }
-  // Toggle the IR mode on/off
-  if (key == 'i')
+
+  for (size_t i = 0; i < devices.size (); i++)
   {
-    if (ir_mode)
+    Device *d = devices[i];
+
+    // Toggle the IR mode on/off
+    if (key == 'i')
     {
-      freenect_set_rgb_format (f_dev, FREENECT_FORMAT_RGB);
-      freenect_start_rgb (f_dev);
+      d->video_request = d->ir_mode ? kinect_calibration::STREAM_RGB : kinect_calibration::STREAM_IR;
     }
-    else
+
+    // save images
+    if (key == 's')
+      postRequest (d, REQ_SAVE);
+
+    // save RGB, depth and IR of one pose
+    if (key == 'v')
+      postRequest (d, REQ_SEQUENCE);
+
+    // back up image number
+    if (key == 'b')
+      postRequest (d, d->ir_mode ? REQ_BACK_IR : REQ_BACK_RGB);
+
+    if (key == '1')
     {
-      freenect_set_rgb_format (f_dev, FREENECT_FORMAT_IR);
-      freenect_start_ir (f_dev);
+      d->source->setLed (LED_GREEN);
     }
-    ir_mode = !ir_mode;
-  }
-
-  // save images
-  if (key == 's')
+    if (key == '2')
     {
-      if (ir_mode) saveIR = true;
-      else 
-        {
-          saveRGB = true;
-          saveDepth = true;
-        }
+      d->source->setLed (LED_RED);
     }
-
-  // back up image number
-  if (key == 'b')
+    if (key == '3')
+    {
+      d->source->setLed (LED_YELLOW);
+    }
+    if (key == '4')
+    {
+      d->source->setLed (LED_BLINK_YELLOW);
+    }
+    if (key == '5')
+    {
+      d->source->setLed (LED_BLINK_GREEN);
+    }
+    if (key == '6')
     {
-      if (ir_mode) ir_num--;
-      else { rgb_num--; depth_num--; }
+      d->source->setLed (LED_BLINK_RED_YELLOW);
+    }
+    if (key == '0')
+    {
+      d->source->setLed (LED_OFF);
     }
 
-  if (key == '1')
-  {
-    freenect_set_led (f_dev, LED_GREEN);
-  }
-  if (key == '2')
-  {
-    freenect_set_led (f_dev, LED_RED);
-  }
-  if (key == '3')
-  {
-    freenect_set_led (f_dev, LED_YELLOW);
-  }
-  if (key == '4')
-  {
-    freenect_set_led (f_dev, LED_BLINK_YELLOW);
+    if (freenect_angle != freenect_angle_last)
+      d->source->setTilt (freenect_angle);
   }
-  if (key == '5')
-  {
-    freenect_set_led (f_dev, LED_BLINK_GREEN);
-  }
-  if (key == '6')
-  {
-    freenect_set_led (f_dev, LED_BLINK_RED_YELLOW);
-  }
-  if (key == '0')
-  {
-    freenect_set_led (f_dev, LED_OFF);
-  }
-
-  if (freenect_angle != freenect_angle_last)
-    freenect_set_tilt_degs (f_dev, freenect_angle);
   freenect_angle_last = freenect_angle;
 }
 
@@ -255,7 +456,7 @@ ReSizeGLScene (int Width, int Height)
   glViewport (0, 0, Width, Height);
   glMatrixMode (GL_PROJECTION);
   glLoadIdentity ();
-  glOrtho (0, 1280, 480, 0, -1.0f, 1.0f);
+  glOrtho (0, 1280 * grid_cols, 480 * grid_rows, 0, -1.0f, 1.0f);
   glMatrixMode (GL_MODELVIEW);
 }
 
@@ -269,22 +470,29 @@ InitGL (int Width, int Height)
   glEnable (GL_BLEND);
   glBlendFunc (GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
   glShadeModel (GL_SMOOTH);
-  glGenTextures (1, &gl_depth_tex);
-  glBindTexture (GL_TEXTURE_2D, gl_depth_tex);
-  glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-  glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-  glGenTextures (1, &gl_rgb_tex);
-  glBindTexture (GL_TEXTURE_2D, gl_rgb_tex);
-  glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-  glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  for (size_t i = 0; i < devices.size (); i++)
+  {
+    Device *d = devices[i];
+    glGenTextures (1, &d->gl_depth_tex);
+    glBindTexture (GL_TEXTURE_2D, d->gl_depth_tex);
+    glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glGenTextures (1, &d->gl_rgb_tex);
+    glBindTexture (GL_TEXTURE_2D, d->gl_rgb_tex);
+    glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  }
   ReSizeGLScene (Width, Height);
 }
 
 void *
 gl_threadfunc (void *arg)
 {
+  // as wide as one device, and as tall as the grid then needs
+  int width = 1280, height = 480 * grid_rows / grid_cols;
+
   glutInitDisplayMode (GLUT_RGBA | GLUT_DOUBLE | GLUT_ALPHA | GLUT_DEPTH);
-  glutInitWindowSize (1280, 480);
+  glutInitWindowSize (width, height);
   glutInitWindowPosition (0, 0);
 
   window = glutCreateWindow ("Calibration Data Acquisition");
@@ -294,271 +502,777 @@ gl_threadfunc (void *arg)
   glutReshapeFunc (&ReSizeGLScene);
   glutKeyboardFunc (&keyPressed);
 
-  InitGL (1280, 480);
+  InitGL (width, height);
 
   glutMainLoop ();
 
   return NULL;
 }
 
-uint16_t t_gamma[2048];
+kinect_calibration::DepthColorizer depth_colorizer (kinect_calibration::DepthColorizer::RGB);
 uint8_t ir_gamma[1024];         // IR gamma
 uint8_t g_gamma[256];           // grayscale gamma
 
 void
-depth_cb (freenect_device * dev, void *v_depth, uint32_t timestamp)
+depth_cb (Device *d, const void *v_depth, const FrameStamp &stamp)
 {
-  int i;
-  freenect_depth *depth = (freenect_depth *)v_depth;
+  const freenect_depth *depth = (const freenect_depth *)v_depth;
 
-  // convert to cv::Mat for saving
-  if (saveDepth)
+  if (d->saveRGB)
     {
-      cv::Mat img(ROWS,COLS,CV_16UC1);
-      uint8_t *imgi = img.ptr<uint8_t>(0);
-      uint8_t *rgbi = (uint8_t *)depth;
-      memcpy(imgi,rgbi,FREENECT_FRAME_PIX*2);
-      char fname[1024];
-      sprintf(fname,"%s/img_depth_%02d.png", fdir, depth_num);
-      depth_num++;
-      if (cv::imwrite(fname,img))
-        printf("Wrote depth image %s\n", fname);
-      else
-        printf("ERROR: failed to write image %s\n", fname);
-      saveDepth = false;
-    }
-
-
-  pthread_mutex_lock (&gl_backbuf_mutex);
-  for (i = 0; i < FREENECT_FRAME_PIX; i++)
-  {
-    int pval = t_gamma[depth[i]];
-    int lb = pval & 0xff;
-    switch (pval >> 8)
-    {
-    case 0:
-      gl_depth_back[3 * i + 0] = 255;
-      gl_depth_back[3 * i + 1] = 255 - lb;
-      gl_depth_back[3 * i + 2] = 255 - lb;
-      break;
-    case 1:
-      gl_depth_back[3 * i + 0] = 255;
-      gl_depth_back[3 * i + 1] = lb;
-      gl_depth_back[3 * i + 2] = 0;
-      break;
-    case 2:
-      gl_depth_back[3 * i + 0] = 255 - lb;
-      gl_depth_back[3 * i + 1] = 255;
-      gl_depth_back[3 * i + 2] = 0;
-      break;
-    case 3:
-      gl_depth_back[3 * i + 0] = 0;
-      gl_depth_back[3 * i + 1] = 255;
-      gl_depth_back[3 * i + 2] = lb;
-      break;
-    case 4:
-      gl_depth_back[3 * i + 0] = 0;
-      gl_depth_back[3 * i + 1] = 255 - lb;
-      gl_depth_back[3 * i + 2] = 255;
-      break;
-    case 5:
-      gl_depth_back[3 * i + 0] = 0;
-      gl_depth_back[3 * i + 1] = 0;
-      gl_depth_back[3 * i + 2] = 255 - lb;
-      break;
-    default:
-      gl_depth_back[3 * i + 0] = 0;
-      gl_depth_back[3 * i + 1] = 0;
-      gl_depth_back[3 * i + 2] = 0;
-      break;
-    }
-  }
-  got_frames++;
-  pthread_cond_signal (&gl_frame_cond);
-  pthread_mutex_unlock (&gl_backbuf_mutex);
+      uint8_t *buf = d->pair_depth.writeBuffer ();
+      *(FrameStamp *)buf = stamp;
+      memcpy (buf + sizeof (FrameStamp), depth, FREENECT_FRAME_PIX * 2);
+      d->pair_depth.setTag (d->save_gen);
+      d->pair_depth.publish ();
+    }
+
+  depth_colorizer.colorize (depth, d->gl_depth_buf.writeBuffer (), FREENECT_FRAME_PIX);
+  d->gl_depth_buf.publish ();
 }
 
 void
-rgb_cb (freenect_device * dev, freenect_pixel * rgb, uint32_t timestamp)
+wakeDetector (Device *d)
 {
-  pthread_mutex_lock (&gl_backbuf_mutex);
-  got_frames++;
-  memcpy (gl_rgb_back, rgb, FREENECT_RGB_SIZE);
+  pthread_mutex_lock (&d->detect_mutex);
+  d->detect_pending = true;
+  pthread_cond_signal (&d->detect_cond);
+  pthread_mutex_unlock (&d->detect_mutex);
+}
 
-  // convert to cv::Mat, and find checkerboard
-  cv::Mat img(ROWS,COLS,CV_8UC3);
-  uint8_t *imgi = img.ptr<uint8_t>(0);
-  uint8_t *rgbi = (uint8_t *)rgb;
-  for (int i=0; i<FREENECT_FRAME_PIX; i++) // use BGR, yech
-    {
-      imgi[i*3+2] = rgbi[i*3];
-      imgi[i*3+1] = rgbi[i*3+1];
-      imgi[i*3] = rgbi[i*3+2];
-    }
+// asks the detector to act on a key, or an autosave
+void
+postRequest (Device *d, int request)
+{
+  pthread_mutex_lock (&d->detect_mutex);
+  d->requests |= request;
+  d->detect_pending = true;
+  pthread_cond_signal (&d->detect_cond);
+  pthread_mutex_unlock (&d->detect_mutex);
+}
 
-  vector<cv::Point2f> corners;
-  bool ret = cv::findChessboardCorners(img, pattern_size, corners);
+// Called from the callbacks.  This is the only copy of a video frame
+// made on the way; the detector and the display both read it there.
+void
+postVideo (Device *d, const void *frame, size_t size, int kind, const FrameStamp &stamp)
+{
+  uint8_t *buf = d->video_buf.writeBuffer ();
+  *(FrameStamp *)buf = stamp;
+  memcpy (buf + sizeof (FrameStamp), frame, size);
+  d->video_buf.setTag (kind);
+  d->video_buf.publish ();
+  wakeDetector (d);
+}
 
-  // convert to color image and display
-  cv::Mat imgc;
-  imgc = img.clone();
-  if (corners.size() > 0)
-    drawChessboardCorners(imgc, pattern_size, cv::Mat(corners), ret);
+// The board is drawn like drawChessboardCorners does, in the same
+// colours (given here as RGB).
+static const GLfloat board_colors[7][3] =
+{
+  { 1.0f, 0.0f, 0.0f }, { 1.0f, 0.5f, 0.0f }, { 0.78f, 0.78f, 0.0f },
+  { 0.0f, 1.0f, 0.0f }, { 0.0f, 0.78f, 0.78f }, { 0.0f, 0.0f, 1.0f },
+  { 1.0f, 0.0f, 1.0f }
+};
+
+// draws the newest board found in this kind of frame, if any, over the
+// frame at x, y: each corner circled and crossed, and the corners joined
+// up in order, a colour per row, if the whole board was found
+void
+drawBoard (Device *d, float x, float y, int kind)
+{
+  d->detect_results.update ();
+  const BoardResult *r = (const BoardResult *)d->detect_results.readBuffer ();
+  if (r->kind != kind || r->ncorners <= 0)
+    return;
+
+  const float radius = 4;
+  glDisable (GL_TEXTURE_2D);
+  glBegin (GL_LINES);
+  for (int i = 0; i < r->ncorners; i++)
+  {
+    int row = i / pattern_size.width;
+    const GLfloat *color = r->found ? board_colors[row % 7] : board_colors[0];
+    glColor4f (color[0], color[1], color[2], 1.0f);
+    float px = x + r->corners[i].x, py = y + r->corners[i].y;
+    if (r->found && i > 0)
+    {
+      // from the last corner, across rows too
+      glVertex3f (x + r->corners[i-1].x, y + r->corners[i-1].y, 0);
+      glVertex3f (px, py, 0);
+    }
+    glVertex3f (px - radius, py - radius, 0);
+    glVertex3f (px + radius, py + radius, 0);
+    glVertex3f (px - radius, py + radius, 0);
+    glVertex3f (px + radius, py - radius, 0);
+    for (int k = 0; k < 12; k++)
+    {
+      float a0 = k * M_PI / 6, a1 = (k + 1) * M_PI / 6;
+      glVertex3f (px + (radius + 1) * cos (a0), py + (radius + 1) * sin (a0), 0);
+      glVertex3f (px + (radius + 1) * cos (a1), py + (radius + 1) * sin (a1), 0);
+    }
+  }
+  glEnd ();
+  glEnable (GL_TEXTURE_2D);
+}
 
-  // redraw
-  imgi = imgc.ptr<uint8_t>(0);
-  for (int i=0; i<FREENECT_FRAME_PIX; i++)
+// Draws the newest video frame at x, y, straight from video_buf (an IR
+// frame is gamma-corrected first), and the board over it.
+void
+drawVideo (Device *d, float x, float y, bool fresh)
+{
+  glBindTexture (GL_TEXTURE_2D, d->gl_rgb_tex);
+  int kind = fresh ? d->video_buf.tag (DISPLAY) : 0;
+  const uint8_t *frame = fresh ? d->video_buf.readBuffer (DISPLAY) + sizeof (FrameStamp) : NULL;
+  if (kind == FRAME_RGB)
+    glTexImage2D (GL_TEXTURE_2D, 0, 3, 640, 480, 0, GL_RGB, GL_UNSIGNED_BYTE, frame);
+  else if (kind == FRAME_IR)
   {
-    gl_rgb_back[3*i + 0] = imgi[i*3+2];
-    gl_rgb_back[3*i + 1] = imgi[i*3+1];
-    gl_rgb_back[3*i + 2] = imgi[i*3];
+    const freenect_pixel_ir *ir = (const freenect_pixel_ir *)frame;
+    for (int i = 0; i < FREENECT_FRAME_PIX; i++)
+      d->ir_preview[i] = ir_gamma[ir[i]];
+    glTexImage2D (GL_TEXTURE_2D, 0, 3, 640, 480, 0, GL_LUMINANCE, GL_UNSIGNED_BYTE, &d->ir_preview[0]);
   }
 
-  if (saveRGB && ret)
+  glBegin (GL_TRIANGLE_FAN);
+  glColor4f (255.0f, 255.0f, 255.0f, 255.0f);
+  glTexCoord2f (0, 0);
+  glVertex3f (x, y, 0);
+  glTexCoord2f (1, 0);
+  glVertex3f (x + 640, y, 0);
+  glTexCoord2f (1, 1);
+  glVertex3f (x + 640, y + 480, 0);
+  glTexCoord2f (0, 1);
+  glVertex3f (x, y + 480, 0);
+  glEnd ();
+
+  drawBoard (d, x, y, d->video_current == kinect_calibration::STREAM_IR ? FRAME_IR : FRAME_RGB);
+}
+
+// what savedImages needs to log a save
+struct SavedGroup
+{
+  Device *d;
+  vector<FrameStamp> stamps;
+};
+
+// Reports saves once the writer has finished them, and notes when each
+// image was taken in the device's timestamps.txt.
+void
+savedImages (const vector<string> &fnames, size_t nplaced, void *arg)
+{
+  SavedGroup *group = (SavedGroup *)arg;
+  for (size_t i = 0; i < fnames.size (); i++)
+    if (i < nplaced)
+      printf("Wrote image %s\n", fnames[i].c_str());
+    else
+      printf("ERROR: failed to write image %s\n", fnames[i].c_str());
+  if (nplaced > 0 && nplaced < fnames.size ())
+    printf("WARNING: only part of the view was saved\n");
+
+  // the ones in place are logged, even from a partial view, so every
+  // image on disk has its time
+  if (nplaced > 0)
     {
-      char fname[1024];
-      sprintf(fname,"%s/img_rgb_%02d.png", fdir, rgb_num);
-      rgb_num++;
-      if (cv::imwrite(fname,img))
-        printf("Wrote RGB image %s\n", fname);
-      else
-        printf("ERROR: failed to write image %s\n", fname);
-      saveRGB = false;
+      Device *d = group->d;
+      pthread_mutex_lock (&d->log_mutex);
+      FILE *f = fopen ((d->dir + "/timestamps.txt").c_str (), "a");
+      if (f)
+        {
+          for (size_t i = 0; i < nplaced; i++)
+            {
+              string name = fnames[i].substr (fnames[i].rfind ('/') + 1);
+              fprintf (f, "%s %u %.6f\n", name.c_str (), group->stamps[i].timestamp,
+                       group->stamps[i].host_time);
+            }
+          fclose (f);
+        }
+      pthread_mutex_unlock (&d->log_mutex);
     }
+  delete group;
+}
 
+// writes images named like img_rgb under one index
+void
+writeImages (Device *d, const vector<string> &names, const vector<cv::Mat> &imgs,
+             const vector<FrameStamp> &stamps, int index)
+{
+  vector<string> fnames;
+  char fname[1024];
+  for (size_t i = 0; i < names.size (); i++)
+    {
+      sprintf(fname,"%s/%s_%02d.png", d->dir.c_str(), names[i].c_str(), index);
+      fnames.push_back (fname);
+    }
+  SavedGroup *group = new SavedGroup;
+  group->d = d;
+  group->stamps = stamps;
+  image_writer->writeGroup (fnames, imgs, savedImages, group);
+}
 
-  pthread_cond_signal (&gl_frame_cond);
-  pthread_mutex_unlock (&gl_backbuf_mutex);
+void
+endSequence (Device *d)
+{
+  d->saveRGB = d->saveIR = false;
+  d->seq_names.clear ();
+  d->seq_imgs.clear ();
+  d->seq_stamps.clear ();
+  d->video_request = d->seq_first == FRAME_IR ? kinect_calibration::STREAM_IR : kinect_calibration::STREAM_RGB;
+  d->seq_active = false;
 }
 
+// Takes the images of one stream.  After the first, switches straight to
+// the other stream, and after the second, straight back; the images are
+// only handed to the writer after that, so encoding them doesn't hold up
+// the switch.
 void
-ir_cb (freenect_device * dev, freenect_pixel_ir * rgb, uint32_t timestamp)
+addToSequence (Device *d, const vector<string> &names, const vector<cv::Mat> &imgs,
+               const vector<FrameStamp> &stamps, int kind)
+{
+  d->seq_names.insert (d->seq_names.end (), names.begin (), names.end ());
+  d->seq_imgs.insert (d->seq_imgs.end (), imgs.begin (), imgs.end ());
+  d->seq_stamps.insert (d->seq_stamps.end (), stamps.begin (), stamps.end ());
+  if (kind == d->seq_first)
+    {
+      if (kind == FRAME_RGB)
+        {
+          d->video_request = kinect_calibration::STREAM_IR;
+          d->saveIR = true;
+        }
+      else
+        {
+          d->video_request = kinect_calibration::STREAM_RGB;
+          requestRGB (d);
+        }
+      return;
+    }
+
+  // RGB and IR indices could have drifted apart; both go on from here
+  int index = max (d->rgb_num, d->ir_num);
+  vector<string> names_all = d->seq_names;
+  vector<cv::Mat> imgs_all = d->seq_imgs;
+  vector<FrameStamp> stamps_all = d->seq_stamps;
+  double ms = (kinect_calibration::hostTime () - d->seq_start) * 1000;
+  endSequence (d);
+  writeImages (d, names_all, imgs_all, stamps_all, index);
+  d->rgb_num = d->ir_num = index + 1;
+  printf("Device %d view %02d: RGB, depth and IR in %.0f ms, %.0f ms of it restarting the video stream\n",
+         d->id, index, ms, d->restart_ms);
+}
+
+void *
+detect_threadfunc (void *arg)
 {
-  pthread_mutex_lock (&gl_backbuf_mutex);
-  got_frames++;
+  Device *d = (Device *)arg;
+  cv::Mat img (ROWS, COLS, CV_8UC1);
+  vector<cv::Point2f> last_corners[3]; // by kind, from the previous frame
 
-  int i;
-  for (i = 0; i < FREENECT_FRAME_PIX; i++)
+  while (!die)
   {
-    int pval = rgb[i];
-    int lb = ir_gamma[pval];
+    pthread_mutex_lock (&d->detect_mutex);
+    while (!d->detect_pending && !die)
+      pthread_cond_wait (&d->detect_cond, &d->detect_mutex);
+    d->detect_pending = false;
+    int requests = d->requests;
+    d->requests = 0;
+    pthread_mutex_unlock (&d->detect_mutex);
+
+    if (requests & REQ_SAVE)
+      triggerSave (d);
+    if (requests & REQ_SEQUENCE)
+      startSequence (d);
+    if (requests & REQ_BACK_RGB)
+      d->rgb_num--;
+    if (requests & REQ_BACK_IR)
+      d->ir_num--;
+
+    if (d->seq_active && kinect_calibration::hostTime () - d->seq_start > SEQ_TIMEOUT)
+      {
+        printf("WARNING: no board in the %s stream of device %d, capture sequence abandoned\n",
+               d->saveRGB ? "RGB" : "IR", d->id);
+        endSequence (d);
+      }
+
+    if (!d->video_buf.update (DETECTOR))
+      continue;
+    int kind = d->video_buf.tag (DETECTOR);
+    FrameStamp stamp = *(const FrameStamp *)d->video_buf.readBuffer (DETECTOR);
+    const uint8_t *frame = d->video_buf.readBuffer (DETECTOR) + sizeof (FrameStamp);
+
+    // The board is looked for in grayscale, so an RGB frame is only
+    // converted once, to gray; it's only made BGR if it is saved.
+    cv::Mat img_rgb;
+    if (kind == FRAME_RGB)
+    {
+      img_rgb = cv::Mat (ROWS, COLS, CV_8UC3, (void *)frame);
+      cv::cvtColor(img_rgb, img, CV_RGB2GRAY);
+    }
+    else
+    {
+      uint8_t *imgi = img.ptr<uint8_t>(0);
+      const freenect_pixel_ir *ir = (const freenect_pixel_ir *)frame;
+      for (int i = 0; i < FREENECT_FRAME_PIX; i++)
+        imgi[i] = (uint8_t)ir_gamma[ir[i]]; // use gamma-corrected for low light
+    }
 
-    gl_rgb_back[3 * i + 0] = lb;
-    gl_rgb_back[3 * i + 1] = lb;
-    gl_rgb_back[3 * i + 2] = lb;
+    // The preview only needs to show whether the board is there, so it
+    // is searched for in a smaller image, bailing out early if it's
+    // clearly not there.  Only a frame we may save gets the full search.
+    bool saving = (kind == FRAME_RGB && d->saveRGB) || (kind == FRAME_IR && d->saveIR);
+    // An RGB frame is saved with a depth frame from after 's'.  There may
+    // not be one yet (the RGB frame came in first), and then it's left to
+    // the next RGB frame.  If depth has stopped coming, the save is given
+    // up rather than leaving an RGB image without its depth image.
+    d->pair_depth.update ();
+    if (kind == FRAME_RGB && saving && d->pair_depth.tag () != d->save_gen)
+      {
+        if (kinect_calibration::hostTime () - d->save_time >= DEPTH_WAIT)
+          {
+            printf("ERROR: no depth frame to go with RGB image %d of device %d, not saved\n",
+                   d->rgb_num, d->id);
+            if (d->seq_active) endSequence (d);
+            d->saveRGB = false;
+          }
+        saving = false;
+      }
+    vector<cv::Point2f> corners;
+    bool ret;
+    d->detections++;
+    if (saving || preview_scale <= 1)
+    {
+      ret = cv::findChessboardCorners(img, pattern_size, corners);
+      if (ret)
+      {
+        cv::cornerSubPix(img, corners, cv::Size(5,5), cv::Size(-1,-1),
+                         cv::TermCriteria(cv::TermCriteria::MAX_ITER+cv::TermCriteria::EPS, 30, 0.1));
+      }
+    }
+    else
+    {
+      cv::Mat small = img;
+      for (int s = 1; s < preview_scale; s *= 2)
+        cv::pyrDown(small, small);
+      ret = cv::findChessboardCorners(small, pattern_size, corners,
+                                      cv::CALIB_CB_ADAPTIVE_THRESH | cv::CALIB_CB_NORMALIZE_IMAGE |
+                                      cv::CALIB_CB_FAST_CHECK);
+      for (size_t i = 0; i < corners.size(); i++)
+        corners[i] *= (float)preview_scale;
+    }
+
+    if (ret) d->boards_found++;
+
+    BoardResult *r = (BoardResult *)d->detect_results.writeBuffer ();
+    r->kind = kind;
+    r->found = ret;
+    r->ncorners = min ((int)corners.size (), MAX_CORNERS);
+    for (int i = 0; i < r->ncorners; i++)
+      r->corners[i] = corners[i];
+    d->detect_results.publish ();
+
+    // The pose is worked out from the corners either way.  In the preview,
+    // a board that holds still (moves less than a preview pixel) in a new
+    // pose starts a save; the next frame, searched in full, is saved if it
+    // is still new and as sharp as those saved before.
+    kinect_calibration::ViewScorer *scorer = kind == FRAME_RGB ? &d->rgb_scorer : &d->ir_scorer;
+    kinect_calibration::BoardView view;
+    bool measured = ret && scorer->measure (corners, view);
+    if (auto_capture && measured && !saving)
+      {
+        const vector<cv::Point2f> &last = last_corners[kind];
+        double moved = 0;
+        if (last.size () == corners.size ())
+          {
+            for (size_t i = 0; i < corners.size (); i++)
+              moved += fabs (corners[i].x - last[i].x) + fabs (corners[i].y - last[i].y);
+            moved /= corners.size ();
+          }
+        if (last.size () == corners.size () && moved < preview_scale &&
+            scorer->novelty (view) >= 1.0)
+          {
+            if (sync_sequence)
+              startSequence (d);
+            else if (kind == FRAME_RGB)
+              requestRGB (d);
+            else
+              d->saveIR = true;
+          }
+      }
+    if (ret)
+      last_corners[kind] = corners;
+    else
+      last_corners[kind].clear ();
+
+    if (saving && measured)
+      {
+        view.sharpness = kinect_calibration::ViewScorer::sharpness (img, corners);
+        double novelty = scorer->novelty (view);
+        // the second image of a sequence is of the same pose, so it's taken
+        if (auto_capture && !(d->seq_active && kind != d->seq_first) &&
+            (novelty < 1.0 || !scorer->sharpEnough (view.sharpness)))
+          {
+            if (d->seq_active) endSequence (d);
+            if (kind == FRAME_RGB) d->saveRGB = false; // moved since, or blurred
+            else d->saveIR = false;
+          }
+        else if ((kind == FRAME_RGB && d->saveRGB) || (kind == FRAME_IR && d->saveIR))
+          {
+            scorer->add (view);
+            printf("Device %d %s view %d: novelty %.1f, sharpness %.2f, tilt %.0f deg, %.0f%% of the image covered\n",
+                   d->id, kind == FRAME_RGB ? "RGB" : "IR", (int)scorer->size (), min (novelty, 99.0),
+                   view.sharpness, view.tilt * 180 / M_PI, scorer->coverage () * 100);
+          }
+      }
+
+    // Only saved once the board is seen, in a frame searched in full.  The
+    // images are handed to the writer, which owns them from then on.
+    if (kind == FRAME_RGB && saving && d->saveRGB && ret)
+      {
+        vector<string> names;
+        vector<cv::Mat> imgs;
+        vector<FrameStamp> stamps;
+        cv::Mat img_bgr;
+        cv::cvtColor(img_rgb, img_bgr, CV_RGB2BGR); // imwrite wants BGR
+        names.push_back ("img_rgb");
+        imgs.push_back (img_bgr);
+        stamps.push_back (stamp);
+
+        // the newest depth frame since 's', under the same index
+        const uint8_t *buf = d->pair_depth.readBuffer ();
+        names.push_back ("img_depth");
+        imgs.push_back (cv::Mat (ROWS, COLS, CV_16UC1, (void *)(buf + sizeof (FrameStamp))).clone ());
+        stamps.push_back (*(const FrameStamp *)buf);
+        d->saveRGB = false;
+        if (d->seq_active)
+          addToSequence (d, names, imgs, stamps, kind);
+        else
+          writeImages (d, names, imgs, stamps, d->rgb_num++);
+      }
+
+    if (kind == FRAME_IR && saving && d->saveIR && ret)
+      {
+        vector<string> names (1, "img_ir");
+        vector<cv::Mat> imgs (1, img.clone ());
+        vector<FrameStamp> stamps (1, stamp);
+        d->saveIR = false;
+        if (d->seq_active)
+          addToSequence (d, names, imgs, stamps, kind);
+        else
+          writeImages (d, names, imgs, stamps, d->ir_num++);
+      }
   }
+  return NULL;
+}
+
+void
+rgb_cb (Device *d, const freenect_pixel * rgb, const FrameStamp &stamp)
+{
+  postVideo (d, rgb, FREENECT_RGB_SIZE, FRAME_RGB, stamp);
+}
 
-  // convert to cv::Mat, and find checkerboard
-  cv::Mat img(ROWS,COLS,CV_8UC1);
-  uint8_t *imgi = img.ptr<uint8_t>(0);
-  for (i = 0; i < FREENECT_FRAME_PIX; i++)
-    //    imgi[i] = (uint8_t)(rgb[i]>>2);
-    imgi[i] = (uint8_t)ir_gamma[rgb[i]]; // use gamma-corrected for low light
+void
+ir_cb (Device *d, const freenect_pixel_ir * rgb, const FrameStamp &stamp)
+{
+  postVideo (d, rgb, FREENECT_FRAME_PIX * sizeof (freenect_pixel_ir), FRAME_IR, stamp);
+}
 
-  vector<cv::Point2f> corners;
-  bool ret = cv::findChessboardCorners(img, pattern_size, corners);
+int autosave_every = 0;         // in headless mode, save every this many video frames
 
-  // convert to color image and display
-  cv::Mat imgc(ROWS,COLS,CV_8UC3);
-  cv::cvtColor(img,imgc,CV_GRAY2RGB,3);
-  if (corners.size() > 0)
-    drawChessboardCorners(imgc, pattern_size, cv::Mat(corners), ret);
+void
+frame_cb (int stream, const void *data, uint32_t timestamp, void *arg)
+{
+  Device *d = (Device *)arg;
+  FrameStamp stamp;
+  stamp.timestamp = timestamp;
+  stamp.host_time = kinect_calibration::hostTime ();
+
+  // copied off before anything else, so the recording keeps up even when
+  // the preview doesn't
+  if (d->recorder)
+    d->recorder->append (stream, timestamp, stamp.host_time, data,
+                         stream == kinect_calibration::STREAM_RGB ? FREENECT_RGB_SIZE
+                         : FREENECT_FRAME_PIX * 2);
+
+  if (d->restart_pending && stream == d->video_current)
+  {
+    d->restart_ms = (stamp.host_time - d->switch_time) * 1000;
+    d->restart_total_ms += d->restart_ms;
+    d->restart_max_ms = max (d->restart_max_ms, (double)d->restart_ms);
+    d->restarts++;
+    d->restart_pending = false;
+  }
+  // the detector only wakes for video frames, which may not be coming
+  if (d->seq_active && stream == kinect_calibration::STREAM_DEPTH)
+    wakeDetector (d);
 
-  // redraw
-  imgi = imgc.ptr<uint8_t>(0);
-  for (i = 0; i < FREENECT_FRAME_PIX; i++)
+  switch (stream)
   {
-    gl_rgb_back[3*i + 0] = imgi[i*3];
-    gl_rgb_back[3*i + 1] = imgi[i*3+1];
-    gl_rgb_back[3*i + 2] = imgi[i*3+2];
+  case kinect_calibration::STREAM_DEPTH:
+    d->depth_frames++;
+    depth_cb (d, data, stamp);
+    break;
+  case kinect_calibration::STREAM_RGB:
+    d->video_frames++;
+    rgb_cb (d, (const freenect_pixel *)data, stamp);
+    break;
+  case kinect_calibration::STREAM_IR:
+    d->video_frames++;
+    ir_cb (d, (const freenect_pixel_ir *)data, stamp);
+    break;
   }
+  if (stream != kinect_calibration::STREAM_DEPTH && autosave_every > 0 &&
+      d->video_frames % autosave_every == 0)
+    postRequest (d, REQ_SAVE);
+}
 
-  if (saveIR && ret)
+// A Kinect through libfreenect.  libfreenect wants plain functions as
+// callbacks; they find their source through the device's user pointer.
+// All the Kinects share one context, whose events are handled for all of
+// them by the first one's process().  The others go on as long as it
+// does, and stop when it fails.
+class FreenectSource : public kinect_calibration::FrameSource
+{
+public:
+  // events is the source that handles the context's events, NULL for
+  // that source itself
+  FreenectSource (freenect_context *ctx, freenect_device *dev, FreenectSource *events)
+    : ctx_(ctx), dev_(dev), events_(events ? events : this), ok_(true), video_(0)
+  {
+    freenect_set_user (dev_, this);
+  }
+
+  bool start (int video)
+  {
+    freenect_set_depth_callback (dev_, depthCb);
+    freenect_set_rgb_callback (dev_, rgbCb);
+    freenect_set_ir_callback (dev_, irCb);
+    freenect_set_depth_format (dev_, FREENECT_FORMAT_11_BIT);
+    freenect_start_depth (dev_);
+    setVideo (video);
+    return true;
+  }
+
+  // Only the video stream restarts; depth keeps going
+  void setVideo (int video)
+  {
+    if (video == video_)
+      return;
+    if (video_ == kinect_calibration::STREAM_IR)
+      freenect_stop_ir (dev_);
+    else if (video_ == kinect_calibration::STREAM_RGB)
+      freenect_stop_rgb (dev_);
+    video_ = video;
+    if (video == kinect_calibration::STREAM_IR)
     {
-      char fname[1024];
-      sprintf(fname,"%s/img_ir_%02d.png", fdir, ir_num);
-      ir_num++;
-      if (cv::imwrite(fname,img))
-        printf("Wrote IR image %s\n", fname);
-      else
-        printf("ERROR: failed to write image %s\n", fname);
-      saveIR = false;
+      freenect_set_rgb_format (dev_, FREENECT_FORMAT_IR);
+      freenect_start_ir (dev_);
     }
+    else
+    {
+      freenect_set_rgb_format (dev_, FREENECT_FORMAT_RGB);
+      freenect_start_rgb (dev_);
+    }
+  }
 
-  pthread_cond_signal (&gl_frame_cond);
-  pthread_mutex_unlock (&gl_backbuf_mutex);
-}
+  bool process ()
+  {
+    if (events_ == this && ok_)
+      ok_ = freenect_process_events (ctx_) >= 0;
+    return events_->ok_;
+  }
 
+  void stop ()
+  {
+    freenect_stop_depth (dev_);
+    freenect_stop_rgb (dev_);
+    freenect_stop_ir (dev_);
+  }
+
+  void setTilt (double degrees)
+  {
+    freenect_set_tilt_degs (dev_, degrees);
+  }
+
+  void setLed (int led)
+  {
+    freenect_set_led (dev_, (freenect_led_options)led);
+  }
+
+private:
+  static FreenectSource *self (freenect_device *dev)
+  {
+    return (FreenectSource *)freenect_get_user (dev);
+  }
+  static void depthCb (freenect_device *dev, void *depth, uint32_t timestamp)
+  {
+    self (dev)->deliver (kinect_calibration::STREAM_DEPTH, depth, timestamp);
+  }
+  static void rgbCb (freenect_device *dev, freenect_pixel *rgb, uint32_t timestamp)
+  {
+    self (dev)->deliver (kinect_calibration::STREAM_RGB, rgb, timestamp);
+  }
+  static void irCb (freenect_device *dev, freenect_pixel_ir *ir, uint32_t timestamp)
+  {
+    self (dev)->deliver (kinect_calibration::STREAM_IR, ir, timestamp);
+  }
+
+  freenect_context *ctx_;
+  freenect_device *dev_;
+  FreenectSource *events_;
+  bool ok_;                     // the context's events are still being handled
+  int video_;                   // the video stream that's running
+};
+
+// One thread captures from every device, taking each one's due frames in
+// turn, so the sources need no locking of their own.
 void *
-freenect_threadfunc (void *arg)
+capture_threadfunc (void *arg)
 {
-  freenect_set_tilt_degs (f_dev, freenect_angle);
-  freenect_set_led (f_dev, LED_RED);
-  freenect_set_depth_callback (f_dev, depth_cb);
-  freenect_set_rgb_callback (f_dev, rgb_cb);
-  freenect_set_ir_callback (f_dev, ir_cb);
-  freenect_set_rgb_format (f_dev, FREENECT_FORMAT_RGB);
-  freenect_set_depth_format (f_dev, FREENECT_FORMAT_11_BIT);
-
-  freenect_start_depth (f_dev);
-  freenect_start_rgb (f_dev);
+  for (size_t i = 0; i < devices.size (); i++)
+  {
+    Device *d = devices[i];
+    d->source->setCallback (frame_cb, d);
+    d->source->setTilt (freenect_angle);
+    d->source->setLed (LED_RED);
+    d->source->start (kinect_calibration::STREAM_RGB);
+  }
 
   printf ("'w'-tilt up, 'c'-center, 'x'-tilt down, '0'-'6'-select LED mode\n");
 
-  while (!die && freenect_process_events (f_ctx) >= 0)
-  {}
+  bool running = true;
+  while (!die && running)
+  {
+    running = false;
+    for (size_t i = 0; i < devices.size (); i++)
+    {
+      Device *d = devices[i];
+      if (d->source->process ())
+        running = true;
+      if (d->video_request != d->video_current)
+      {
+        d->switch_time = kinect_calibration::hostTime ();
+        d->source->setVideo (d->video_request);
+        d->video_current = d->video_request;
+        d->ir_mode = d->video_current == kinect_calibration::STREAM_IR;
+        d->restart_pending = true;
+      }
+    }
+  }
 
   printf ("\nshutting down streams...\n");
-
-  freenect_stop_depth (f_dev);
-  freenect_stop_rgb (f_dev);
-  freenect_stop_ir (f_dev);
+  for (size_t i = 0; i < devices.size (); i++)
+  {
+    Device *d = devices[i];
+    if (d->restarts > 0)
+      printf ("Device %d: the video stream restarted %d times, in %.0f ms on average and %.0f ms at most\n",
+              d->id, d->restarts, d->restart_total_ms / d->restarts, d->restart_max_ms);
+    d->source->stop ();
+  }
 
   printf ("-- done!\n");
   return NULL;
 }
 
+// "0,2" -> 0 2
+vector<int>
+parseDevices (const char *arg)
+{
+  vector<int> ids;
+  const char *p = arg;
+  while (*p)
+  {
+    char *end;
+    long id = strtol (p, &end, 10);
+    if (end == p || id < 0)
+      return vector<int> ();
+    ids.push_back ((int)id);
+    p = *end == ',' ? end + 1 : end;
+    if (*end && *end != ',')
+      return vector<int> ();
+  }
+  return ids;
+}
+
 int
 main(int argc, char **argv)
 {
-  // Parse GLUT-specific options
-  glutInit (&argc, argv);
+  // Parse GLUT-specific options, unless there won't be a window (GLUT
+  // gives up without a display)
+  bool headless = false;
+  for (int i = 1; i < argc; i++)
+    if (strcmp (argv[i], "-H") == 0)
+      headless = true;
+  if (!headless)
+    glutInit (&argc, argv);
 
   pattern_size = cv::Size(0,0);
+  vector<const char *> replay;
+  const char *record = NULL;
+  double replay_rate = 1.0;
+  vector<int> device_ids (1, 0);
   opterr = 0;
   int c;
-  while ((c = getopt(argc, argv, "r:c:")) != -1)
+  while ((c = getopt(argc, argv, "r:c:p:aSR:x:Hn:o:d:")) != -1)
   {
     switch (c)
     {
+      case 'R':
+        replay.push_back (optarg);
+        break;
+      case 'x':
+        replay_rate = atof(optarg);
+        break;
+      case 'H':
+        break;
+      case 'a':
+        auto_capture = true;
+        break;
+      case 'S':
+        sync_sequence = true;
+        break;
+      case 'o':
+        record = optarg;
+        break;
+      case 'd':
+        device_ids = parseDevices (optarg);
+        break;
+      case 'n':
+        autosave_every = atoi(optarg);
+        break;
       case 'r':
         pattern_size.height = atoi(optarg);
         break;
       case 'c':
         pattern_size.width = atoi(optarg);
         break;
+      case 'p':
+        preview_scale = atoi(optarg);
+        break;
     }
   }
 
   if (optind < argc)
     fdir = argv[optind];
 
-  if (pattern_size.width == 0 || pattern_size.height == 0 || fdir == NULL)
+  if (pattern_size.width == 0 || pattern_size.height == 0 || fdir == NULL ||
+      (preview_scale != 1 && preview_scale != 2 && preview_scale != 4) || device_ids.empty ())
   {
     printf("Must give the checkerboard width/height and data directory.\n"
            "Usage:\n"
-           "%s -r ROWS -c COLS my_data_dir\n", argv[0]);
+           "%s -r ROWS -c COLS [-p PREVIEW_SCALE (1, 2 or 4)] [-a] [-S] [-d DEVICES]\n"
+           "   [-R RECORDING [-R ...] [-x RATE]] [-o RECORDING] [-H [-n SAVE_EVERY]] my_data_dir\n"
+           "-a saves views by itself, whenever the board holds still somewhere new\n"
+           "-S saves RGB, depth and IR together, switching between RGB and IR\n"
+           "   ('v' does this without -S)\n"
+           "-d captures from the Kinects numbered in DEVICES, e.g. 0,1,2; with\n"
+           "   more than one, each one's images go to my_data_dir/devN\n"
+           "-R plays a recording instead of using a Kinect, at RATE times\n"
+           "   the recorded speed (0 is as fast as possible); each -R is a device\n"
+           "-o records the raw depth, RGB and IR streams as they come in\n"
+           "   (RECORDING_devN for each of several devices)\n"
+           "-H runs without a window until the recording ends (or Ctrl-C), saving the\n"
+           "   board every SAVE_EVERY RGB/IR frames, and prints frame rates\n", argv[0]);
     return 1;
   }
 
   int i;
-  for (i = 0; i < 2048; i++)
-  {
-    float v = i / 2048.0;
-    v = powf (v, 3) * 6;
-    t_gamma[i] = v * 6 * 256;
-  }
-
   for (i = 0; i < 1024; i++)
   {
     float v = i / 1024.0;
@@ -573,31 +1287,113 @@ main(int argc, char **argv)
     g_gamma[i] = v * 256;
   }
 
-  if (freenect_init (&f_ctx, NULL) < 0)
+  // each recording stands in for a device
+  vector<kinect_calibration::FrameSource *> sources;
+  vector<kinect_calibration::FrameRecording *> recordings;
+  if (!replay.empty ())
   {
-    printf ("freenect_init() failed\n");
-    return 1;
+    device_ids.clear ();
+    for (size_t r = 0; r < replay.size (); r++)
+    {
+      recordings.push_back (new kinect_calibration::FrameRecording ());
+      if (!recordings[r]->open (replay[r]))
+        return 1;
+      printf ("Playing %d frames from %s\n", (int)recordings[r]->size (), replay[r]);
+      sources.push_back (new kinect_calibration::ReplaySource (*recordings[r], replay_rate));
+      device_ids.push_back (r);
+    }
   }
+  else
+  {
+    if (freenect_init (&f_ctx, NULL) < 0)
+    {
+      printf ("freenect_init() failed\n");
+      return 1;
+    }
 
-  freenect_set_log_level (f_ctx, FREENECT_LOG_ERROR);
+    freenect_set_log_level (f_ctx, FREENECT_LOG_ERROR);
 
-  int nr_devices = freenect_num_devices (f_ctx);
-  printf ("Number of devices found: %d\n", nr_devices);
+    int nr_devices = freenect_num_devices (f_ctx);
+    printf ("Number of devices found: %d\n", nr_devices);
 
-  int user_device_number = 0;
-  if (argc > 1)
-    user_device_number = atoi (argv[1]);
+    if (nr_devices < 1)
+      return 1;
 
-  if (nr_devices < 1)
-    return 1;
+    for (size_t k = 0; k < device_ids.size (); k++)
+    {
+      freenect_device *dev;
+      if (freenect_open_device (f_ctx, &dev, device_ids[k]) < 0)
+      {
+        printf ("Could not open device %d\n", device_ids[k]);
+        return 1;
+      }
+      sources.push_back (new FreenectSource (f_ctx, dev, k == 0 ? NULL
+                                             : (FreenectSource *)sources[0]));
+    }
+  }
 
-  if (freenect_open_device (f_ctx, &f_dev, user_device_number) < 0)
+  for (size_t k = 0; k < sources.size (); k++)
   {
-    printf ("Could not open device\n");
-    return 1;
+    string dir = fdir;
+    char name[64];
+    if (sources.size () > 1)
+    {
+      sprintf (name, "/dev%d", device_ids[k]);
+      dir += name;
+      mkdir (dir.c_str (), 0755);
+    }
+    Device *d = new Device (device_ids[k], dir, sources[k]);
+
+    if (record)
+    {
+      string fname = record;
+      if (sources.size () > 1)
+      {
+        sprintf (name, "_dev%d", device_ids[k]);
+        fname += name;
+      }
+      d->recorder = new kinect_calibration::FrameRecordWriter ();
+      if (!d->recorder->open (fname))
+      {
+        printf ("Could not write %s\n", fname.c_str ());
+        return 1;
+      }
+    }
+    devices.push_back (d);
+  }
+
+  grid_cols = devices.size () <= 2 ? 1 : 2;
+  grid_rows = (devices.size () + grid_cols - 1) / grid_cols;
+
+  image_writer = new kinect_calibration::ImageWriter (2);
+
+  for (size_t k = 0; k < devices.size (); k++)
+    if (pthread_create (&devices[k]->detect_thread, NULL, detect_threadfunc, devices[k]))
+    {
+      printf ("pthread_create failed\n");
+      return 1;
+    }
+
+  if (headless)
+  {
+    signal (SIGINT, stopCapture);
+    signal (SIGTERM, stopCapture);
+    double start = kinect_calibration::hostTime ();
+    capture_threadfunc (NULL);
+    double secs = kinect_calibration::hostTime () - start;
+    shutDown ();
+    for (size_t k = 0; k < devices.size (); k++)
+    {
+      Device *d = devices[k];
+      printf ("Device %d: %ld depth frames (%.1f Hz), %ld video frames (%.1f Hz), "
+              "%ld detections (%.1f Hz), board found in %ld\n", d->id,
+              d->depth_frames, d->depth_frames / secs, d->video_frames, d->video_frames / secs,
+              d->detections, d->detections / secs, d->boards_found);
+    }
+    return 0;
   }
 
-  if (pthread_create (&freenect_thread, NULL, freenect_threadfunc, NULL))
+  if (pthread_create (&capture_thread, NULL, capture_threadfunc, NULL))
   {
     printf ("pthread_create failed\n");
     return 1;
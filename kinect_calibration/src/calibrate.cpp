@@ -42,7 +42,9 @@
 #include <string.h>
 #include <iostream>
 #include <unistd.h> // getopt
+#include <sys/time.h>
 #include <cstdlib>
+#include <map>
 
 #include <math.h>
 #include <opencv2/core/core.hpp>
@@ -53,6 +55,14 @@
 #include <Eigen/Core>
 #include <Eigen/LU>
 
+#include <kinect_calibration/depth_colorizer.h>
+#include <kinect_calibration/depth_correction.h>
+#include <kinect_calibration/image_writer.h>
+#include <kinect_calibration/kinect_params.h>
+#include <kinect_calibration/parallel.h>
+#include <kinect_calibration/registration.h>
+#include <kinect_calibration/shift_lut.h>
+
 using namespace cv;
 using namespace Eigen;
 using namespace std;
@@ -64,61 +74,6 @@ using namespace std;
 // Pixel offset from IR image to depth image
 cv::Point2f ir_depth_offset = cv::Point2f(-4, -3);
 
-#define SHIFT_SCALE 0.125
-
-// change shift to disparity
-double shift2disp(int shift, double shift_offset)
-{
-  return SHIFT_SCALE*(double)(shift_offset - shift);
-}
-
-// colorizes a depth pixel
-uint16_t t_gamma[2048];         // gamma conversion for depth
-
-void setDepthColor(uint8_t *cptr, int d)
-{
-  int pval = t_gamma[d];
-  int lb = pval & 0xff;
-  switch (pval >> 8)
-    {
-    case 0:
-      cptr[2] = 255;
-      cptr[1] = 255 - lb;
-      cptr[0] = 255 - lb;
-      break;
-    case 1:
-      cptr[2] = 255;
-      cptr[1] = lb;
-      cptr[0] = 0;
-      break;
-    case 2:
-      cptr[2] = 255 - lb;
-      cptr[1] = 255;
-      cptr[0] = 0;
-      break;
-    case 3:
-      cptr[2] = 0;
-      cptr[1] = 255;
-      cptr[0] = lb;
-      break;
-    case 4:
-      cptr[2] = 0;
-      cptr[1] = 255 - lb;
-      cptr[0] = 255;
-      break;
-    case 5:
-      cptr[2] = 0;
-      cptr[1] = 0;
-      cptr[0] = 255 - lb;
-      break;
-    default:
-      cptr[2] = 0;
-      cptr[1] = 0;
-      cptr[0] = 0;
-      break;
-    }
-}
-
 void writeCalibration(FILE *f, const cv::Mat& cameraMatrix, const cv::Mat& distCoeffs)
 {
   const double *K = cameraMatrix.ptr<double>();
@@ -151,163 +106,574 @@ void writeCalibration(FILE *f, const cv::Mat& cameraMatrix, const cv::Mat& distC
           K[0], K[1], K[2], K[3], K[4], K[5], K[6], K[7], K[8]);
 }
 
-// 
-// read in IR images, perform monocular calibration, check distortion
-// arguments:
-//   [dir]          data directory (without trailing slash); default cwd
-//   [cell size, m] size of edge of each square in chessboard
-//   [#rows #cols]  number of rows and cols of interior chessboard;
-//                  default 6x7
-//
+// count the images img_<kind>_NN.png in fdir, stopping at the first one missing
+int countImages(const char *fdir, const char *kind)
+{
+  int n = 0;
+  char fname[1024];
+  while (1)
+    {
+      sprintf(fname,"%s/img_%s_%02d.png",fdir,kind,n);
+      if (access(fname, R_OK) != 0) break;
+      n++;
+    }
+  return n;
+}
 
-int
-main(int argc, char **argv)
+// one image to load, and maybe find the chessboard in
+struct View
+{
+  string fname;
+  string name;                  // without the directory, for the corner cache
+  int flags;                    // for imread
+  bool detect;                  // look for the chessboard
+  bool keep;                    // keep the image even if we detect, for the diagnostics
+  Size pattern;
+  bool loaded, found;
+  bool cached;                  // corners came from the corner cache
+  uint64_t hash;                // of the file contents
+  Mat img;                      // only kept if we aren't detecting, or keep is set
+  vector<Point2f> corners;
+};
+
+// Chessboard corners found in each image, kept in corners.cache in the
+// data directory so a rerun only looks at images that are new or have
+// changed.  An entry is only used if the hash of the image file and the
+// pattern size still match.
+struct CachedCorners
 {
-  // checkerboard pattern
-  int ccols = 0;
-  int crows = 0;
+  uint64_t hash;
+  Size pattern;
+  bool found;
+  vector<Point2f> corners;
+};
+typedef map<string, CachedCorners> CornerCache;
 
-  // cell size
-  double csize = 0.0;
+#define CORNER_CACHE_HEADER "# kinect_calibration corner cache 1"
 
-  char *fdir = NULL;
+// 64-bit FNV-1a
+uint64_t hashBytes(const uchar *p, size_t n)
+{
+  uint64_t h = 14695981039346656037ULL;
+  for (size_t i = 0; i < n; i++)
+    {
+      h ^= p[i];
+      h *= 1099511628211ULL;
+    }
+  return h;
+}
 
-  opterr = 0;
-  int c;
-  while ((c = getopt(argc, argv, "r:c:s:")) != -1)
-  {
-    switch (c)
+bool readFileBytes(const string &fname, vector<uchar> &buf)
+{
+  FILE *f = fopen(fname.c_str(), "rb");
+  if (!f) return false;
+  fseek(f, 0, SEEK_END);
+  long n = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  buf.resize(n > 0 ? n : 0);
+  bool ok = n > 0 && fread(&buf[0], 1, n, f) == (size_t)n;
+  fclose(f);
+  return ok;
+}
+
+// One line per image: name, hash, pattern size, found, number of corners,
+// then the corners.  A missing or unreadable cache is just empty.
+void readCornerCache(const char *fdir, CornerCache &cache)
+{
+  char fname[1024];
+  sprintf(fname,"%s/corners.cache",fdir);
+  FILE *f = fopen(fname, "r");
+  if (!f) return;
+  char line[256], name[1024];
+  if (!fgets(line, sizeof(line), f) || strncmp(line, CORNER_CACHE_HEADER, strlen(CORNER_CACHE_HEADER)))
     {
-      case 'r':
-        crows = atoi(optarg);
-        break;
-      case 'c':
-        ccols = atoi(optarg);
-        break;
-      case 's':
-        csize = atof(optarg);
-        break;
+      fclose(f);
+      return;
     }
-  }
+  unsigned long long hash;
+  int w, h, found, n;
+  while (fscanf(f, "%1023s %llx %d %d %d %d", name, &hash, &w, &h, &found, &n) == 6)
+    {
+      CachedCorners c;
+      c.hash = hash;
+      c.pattern = Size(w,h);
+      c.found = found != 0;
+      c.corners.resize(n);
+      int i;
+      for (i = 0; i < n; i++)
+        if (fscanf(f, "%f %f", &c.corners[i].x, &c.corners[i].y) != 2)
+          break;
+      if (i < n) break;         // truncated
+      cache[name] = c;
+    }
+  fclose(f);
+}
 
-  if (optind < argc)
-    fdir = argv[optind];
+// Rewrites the cache from the views just loaded.  Written to a temporary
+// file first, so an interrupted run can't leave a half-written cache.
+void writeCornerCache(const char *fdir, const vector<View> &views)
+{
+  char fname[1024], tmpname[1024];
+  sprintf(fname,"%s/corners.cache",fdir);
+  sprintf(tmpname,"%s/corners.cache.tmp",fdir);
+  FILE *f = fopen(tmpname, "w");
+  if (!f) return;
+  fprintf(f, "%s\n", CORNER_CACHE_HEADER);
+  for (size_t i = 0; i < views.size(); i++)
+    {
+      const View &v = views[i];
+      if (!v.detect || !v.loaded) continue;
+      fprintf(f, "%s %016llx %d %d %d %d", v.name.c_str(), (unsigned long long)v.hash,
+              v.pattern.width, v.pattern.height, v.found ? 1 : 0, (int)v.corners.size());
+      for (size_t j = 0; j < v.corners.size(); j++)
+        fprintf(f, " %.4f %.4f", v.corners[j].x, v.corners[j].y);
+      fprintf(f, "\n");
+    }
+  bool ok = !ferror(f);
+  fclose(f);
+  if (ok)
+    rename(tmpname, fname);
+  else
+    unlink(tmpname);
+}
+
+void addViews(vector<View> &views, const char *fdir, const char *kind, int n,
+              int flags, bool detect, Size pattern)
+{
+  for (int i=0; i<n; i++)
+    {
+      char fname[1024];
+      sprintf(fname,"img_%s_%02d.png",kind,i);
+      View v;
+      v.name = fname;
+      v.fname = string(fdir) + "/" + fname;
+      v.flags = flags;
+      v.detect = detect;
+      v.keep = false;
+      v.pattern = pattern;
+      v.loaded = v.found = v.cached = false;
+      v.hash = 0;
+      views.push_back(v);
+    }
+}
+
+// the views to load, and the corners found last time if we can use them
+struct LoadJob
+{
+  vector<View> *views;
+  const CornerCache *cache;     // NULL to detect everything again
+};
+
+// parallelFor body: each view is independent, and only touches its own entry
+void loadView(int i, void *arg)
+{
+  LoadJob *job = (LoadJob *)arg;
+  View &v = (*job->views)[i];
+
+  // the file is read once, both to hash it and to decode it
+  vector<uchar> buf;
+  if (!readFileBytes(v.fname, buf)) return;
+  v.hash = hashBytes(&buf[0], buf.size());
+  if (v.detect && job->cache)
+    {
+      CornerCache::const_iterator it = job->cache->find(v.name);
+      if (it != job->cache->end() && it->second.hash == v.hash &&
+          it->second.pattern == v.pattern)
+        {
+          v.cached = true;
+          v.found = it->second.found;
+          v.corners = it->second.corners;
+          if (v.keep)
+            v.img = imdecode(Mat(buf),v.flags);
+          v.loaded = !v.keep || v.img.data != NULL;
+          return;
+        }
+    }
+
+  Mat img = imdecode(Mat(buf),v.flags);
+  v.loaded = img.data != NULL;
+  if (!v.loaded) return;
+  if (!v.detect || v.keep)
+    v.img = img;
+  if (!v.detect)
+    return;
+
+  v.found = cv::findChessboardCorners(img,v.pattern,v.corners);
+  if (!v.found) return;
+
+  Mat gray = img;
+  if (img.channels() == 3)
+    cv::cvtColor(img, gray, CV_RGB2GRAY);
+  cv::cornerSubPix(gray, v.corners, Size(5,5), Size(-1,-1),
+                   TermCriteria(TermCriteria::MAX_ITER+TermCriteria::EPS, 30, 0.1));
+}
+
+// Calibrates one camera, and finds the RMS reprojection error of each
+// view.  Returns the overall error.
+double calibrateMono(const vector<vector<Point3f> > &pats, const vector<vector<Point2f> > &points,
+                     Mat &camMatrix, Mat &distCoeffs, vector<Mat> &rvecs, vector<Mat> &tvecs,
+                     int flags, vector<double> &errs)
+{
+  double rp_err = calibrateCamera(pats, points, Size(COLS,ROWS), camMatrix, distCoeffs,
+                                  rvecs, tvecs, flags);
+  errs.resize(pats.size());
+  for (size_t v = 0; v < pats.size(); v++)
+    {
+      vector<Point2f> proj;
+      projectPoints(Mat(pats[v]), rvecs[v], tvecs[v], camMatrix, distCoeffs, proj);
+      double sum = 0.0;
+      for (size_t j = 0; j < proj.size(); j++)
+        {
+          Point2f d = proj[j] - points[v][j];
+          sum += d.x*d.x + d.y*d.y;
+        }
+      errs[v] = sqrt(sum / proj.size());
+    }
+  return rp_err;
+}
+
+// per-frame diagnostic images written after calibrating, for -w
+enum
+{
+  DIAG_DEPTH_RECT       = 1,  // img_depth_rect_NN.png
+  DIAG_DEPTH_RECT_COLOR = 2,  // img_depth_rect_color_NN.png
+  DIAG_DEPTH_COLOR      = 4,  // img_depth_color_NN.png
+  DIAG_RGB_MAPPED       = 8,  // img_rgb_mapped_NN.png
+  DIAG_RGB_RECT         = 16, // img_rgb_rect_NN.png
+  DIAG_ALL              = 31
+};
+
+// Parses a comma-separated list of depth_rect, depth_rect_color,
+// depth_color, rgb_mapped, rgb_rect, all or none.  Returns -1 for
+// anything else.
+int parseDiagnostics(const char *list)
+{
+  static const struct { const char *name; int flag; } names[] =
+    {
+      { "depth_rect", DIAG_DEPTH_RECT },
+      { "depth_rect_color", DIAG_DEPTH_RECT_COLOR },
+      { "depth_color", DIAG_DEPTH_COLOR },
+      { "rgb_mapped", DIAG_RGB_MAPPED },
+      { "rgb_rect", DIAG_RGB_RECT },
+      { "all", DIAG_ALL },
+      { "none", 0 },
+    };
+  int flags = 0;
+  string s(list);
+  size_t start = 0;
+  while (start <= s.size())
+    {
+      size_t end = s.find(',', start);
+      if (end == string::npos) end = s.size();
+      string name = s.substr(start, end - start);
+      size_t i;
+      for (i = 0; i < sizeof(names)/sizeof(names[0]); i++)
+        if (name == names[i].name)
+          break;
+      if (i == sizeof(names)/sizeof(names[0]))
+        return -1;
+      flags |= names[i].flag;
+      start = end + 1;
+    }
+  return flags;
+}
+
+// settings shared by every directory we calibrate
+struct CalibOptions
+{
+  int crows, ccols;             // interior corners of the checkerboard
+  double csize;                 // cell size, m
+  double max_err;               // views with a larger reprojection error are dropped; 0 keeps all
+  int nthreads;                 // for loading images and registration; 0 is one per core
+  bool use_cache;               // reuse the corners in corners.cache
+  bool warm_start;              // start from the last calibration of the directory
+  int correction_tile;          // tile size of the dense depth correction; 0 for none
+  int diagnostics;              // DIAG_* images to write; 0 writes only the parameters
+};
+
+// what calibrating one directory came up with, for the batch summary
+struct CalibResult
+{
+  bool ok;
+  int nviews, nframes;          // views used, frames in the directory
+  double err_depth, err_rgb, err_stereo; // reprojection errors
+  double baseline, shift_offset;
+  double seconds;
+};
+
+// 
+// read in IR images, perform monocular calibration, check distortion,
+// and write the calibration and rectified images into fdir.  Progress
+// goes to log.
+//
+int
+calibrateDirectory(const CalibOptions &opt, const char *fdir, FILE *log, CalibResult &result)
+{
+  memset(&result, 0, sizeof(result));
+  int crows = opt.crows;
+  int ccols = opt.ccols;
+  double csize = opt.csize;
+  double max_err = opt.max_err;
 
-  if (crows == 0 || ccols == 0 || csize == 0.0 || fdir == NULL)
-  {
-    printf("Must give the checkerboard dimensions and data directory.\n"
-           "Usage:\n"
-           "%s -r ROWS -c COLS -s SQUARE_SIZE my_data_dir\n", argv[0]);
-    return 1;
-  }
-    
   // construct the planar pattern
   vector<Point3f> pat;
   for (int i=0; i<ccols; i++)
     for (int j=0; j<crows; j++)
       pat.push_back(Point3f(i*csize,j*csize,0));
 
-  // read in images, set up feature points and patterns
-  vector<vector<Point3f> > pats;
-  vector<vector<Point2f> > points;
-
-  int fnum = 0;
-
-  while (1)
+  // Load every image and find the corners in parallel.  Each view fills
+  // in its own entry, and we go through them in frame order afterwards.
+  int nir = countImages(fdir,"ir");
+  int ndepth = countImages(fdir,"depth");
+  int nrgb = countImages(fdir,"rgb");
+  if (nir == 0)
     {
-      char fname[1024];
-      sprintf(fname,"%s/img_ir_%02d.png",fdir,fnum++);
-      Mat img = imread(fname,-1);
-      if (img.data == NULL) break; // no data, not read, break out
-
-      vector<cv::Point2f> corners;
-      bool ret = cv::findChessboardCorners(img,Size(crows,ccols),corners);
-
-      if (ret)
-        printf("Found corners in image %s\n",fname);
-      else {
-        printf("*** Didn't find corners in image %s\n",fname);
-        return 1;
+      fprintf(log, "*** No IR images in %s\n",fdir);
+      return 1;
+    }
+  vector<View> views;
+  addViews(views, fdir, "ir", nir, -1, true, Size(crows,ccols));
+  addViews(views, fdir, "depth", ndepth, -1, false, Size(crows,ccols));
+  addViews(views, fdir, "rgb", nrgb, 1, true, Size(crows,ccols));
+  // the diagnostic images below use the RGB images again
+  if (opt.diagnostics & (DIAG_RGB_MAPPED | DIAG_RGB_RECT))
+    for (int i = 0; i < nrgb; i++)
+      views[nir + ndepth + i].keep = true;
+  CornerCache cache;
+  if (opt.use_cache)
+    readCornerCache(fdir, cache);
+  LoadJob job;
+  job.views = &views;
+  job.cache = opt.use_cache ? &cache : NULL;
+  kinect_calibration::parallelFor(views.size(), loadView, &job, opt.nthreads);
+  writeCornerCache(fdir, views);
+  int ncached = 0, ndetect = 0;
+  for (size_t i = 0; i < views.size(); i++)
+    if (views[i].detect && views[i].loaded)
+      {
+        ndetect++;
+        if (views[i].cached) ncached++;
       }
-
-      cv::cornerSubPix(img, corners, Size(5,5), Size(-1,-1),
-                       TermCriteria(TermCriteria::MAX_ITER+TermCriteria::EPS, 30, 0.1));
+  fprintf(log, "Corners of %d of %d images from the corner cache\n", ncached, ndetect);
+  View *irViews = &views[0];
+  View *depthViews = irViews + nir;
+  View *rgbViews = depthViews + ndepth;
+
+  // A frame is only used if the board was found in both its IR and RGB
+  // images and it has a depth image, so every calibration below sees the
+  // same views.  Bad frames are reported and skipped.
+  int nframes = max(nir, max(ndepth, nrgb));
+  vector<int> frames;           // frame number of each view in use
+  vector<string> status(nframes, "ok");
+  int fnum;
+
+  for (fnum = 0; fnum < nframes; fnum++)
+    {
+      if (fnum < nir && irViews[fnum].found)
+        fprintf(log, "Found corners in image %s\n",irViews[fnum].fname.c_str());
+      if (fnum < nrgb && rgbViews[fnum].found)
+        fprintf(log, "Found corners in image %s\n",rgbViews[fnum].fname.c_str());
+
+      if (fnum >= nir || !irViews[fnum].loaded)
+        status[fnum] = "no IR image";
+      else if (!irViews[fnum].found)
+        status[fnum] = "no board in IR image";
+      else if (fnum >= ndepth || !depthViews[fnum].loaded)
+        status[fnum] = "no depth image";
+      else if (fnum >= nrgb || !rgbViews[fnum].loaded)
+        status[fnum] = "no RGB image";
+      else if (!rgbViews[fnum].found)
+        status[fnum] = "no board in RGB image";
+
+      if (status[fnum] != "ok")
+        {
+          fprintf(log, "*** Skipping frame %02d: %s\n", fnum, status[fnum].c_str());
+          continue;
+        }
 
       // Adjust corners detected in IR image to where they would appear in the depth image
+      vector<cv::Point2f> &corners = irViews[fnum].corners;
       for (int i = 0; i < corners.size(); ++i)
         corners[i] += ir_depth_offset;
 
-      pats.push_back(pat);
-      points.push_back(corners);
+      frames.push_back(fnum);
+    }
+
+  result.nframes = nframes;
+  result.nviews = frames.size();
+  if (frames.size() < 3)
+    {
+      fprintf(log, "*** Only %d usable views, need at least 3\n", (int)frames.size());
+      return 1;
+    }
+
+  // Monocular calibration of both cameras.  If an error limit was given,
+  // views over it in either camera are dropped and both are calibrated
+  // again from the rest.
+  Mat camMatrix, distCoeffs;    // depth camera
+  Mat camMatrixRGB, distCoeffsRGB;
+  vector<Mat> rvecs, tvecs;     // depth camera poses, for the depth fit
+  vector<Mat> rvecsRGB, tvecsRGB;
+  vector<double> errIR, errRGB; // per view in use
+  vector<double> frameErrIR(nframes, -1.0), frameErrRGB(nframes, -1.0); // per frame
+  vector<vector<Point3f> > pats;
+  vector<vector<Point2f> > points, pointsRGB;
+  double rp_err, rp_errRGB;
+
+  // With -i, start from the last calibration of this directory if there
+  // is one, so adding a few views only nudges the solution.  Off by
+  // default, since the result then depends on what was there before.
+  Mat warmK, warmD, warmKRGB, warmDRGB;
+  int warmFlag = 0;
+  if (opt.warm_start)
+    {
+      string depth_fname = string(fdir) + "/calibration_depth.yaml";
+      string rgb_fname = string(fdir) + "/calibration_rgb.yaml";
+      double K[9], D[5], KRGB[9], DRGB[5];
+      if (access(depth_fname.c_str(), R_OK) == 0 && access(rgb_fname.c_str(), R_OK) == 0 &&
+          kinect_calibration::readCalibration(depth_fname, K, D) &&
+          kinect_calibration::readCalibration(rgb_fname, KRGB, DRGB))
+        {
+          warmK = Mat(3,3,CV_64F,K).clone();
+          warmD = Mat(5,1,CV_64F,D).clone();
+          warmKRGB = Mat(3,3,CV_64F,KRGB).clone();
+          warmDRGB = Mat(5,1,CV_64F,DRGB).clone();
+          warmFlag = CV_CALIB_USE_INTRINSIC_GUESS;
+          fprintf(log, "Starting from the previous calibration\n");
+        }
     }
 
+  for (int pass = 0; ; pass++)
+    {
+      pats.clear();
+      points.clear();
+      pointsRGB.clear();
+      for (size_t v = 0; v < frames.size(); v++)
+        {
+          pats.push_back(pat);
+          points.push_back(irViews[frames[v]].corners);
+          pointsRGB.push_back(rgbViews[frames[v]].corners);
+        }
+
+      // Currently assuming zero distortion
+      camMatrix = warmFlag ? warmK.clone() : Mat();
+      distCoeffs = warmFlag ? warmD.clone() : Mat();
+      rp_err = calibrateMono(pats, points, camMatrix, distCoeffs, rvecs, tvecs,
+                             warmFlag |
+                             CV_CALIB_FIX_K3 | 
+                             CV_CALIB_FIX_K2 | 
+                             CV_CALIB_FIX_K1 | 
+                             CV_CALIB_ZERO_TANGENT_DIST |
+                             //CV_CALIB_FIX_PRINCIPAL_POINT |
+                             CV_CALIB_FIX_ASPECT_RATIO,
+                             errIR);
+
+      // initialize camera matrix
+      camMatrixRGB = (Mat_<double>(3,3) << 1, 0, 320, 0, 1, 240, 0, 0, 1);
+      distCoeffsRGB = Mat::zeros(5,1,CV_64F);
+      if (warmFlag)
+        {
+          camMatrixRGB = warmKRGB.clone();
+          distCoeffsRGB = warmDRGB.clone();
+        }
+      rp_errRGB = calibrateMono(pats, pointsRGB, camMatrixRGB, distCoeffsRGB, rvecsRGB, tvecsRGB,
+                                warmFlag |
+                                //CV_CALIB_FIX_K1 |
+                                //CV_CALIB_FIX_K2 |
+                                CV_CALIB_FIX_K3 |
+                                CV_CALIB_ZERO_TANGENT_DIST |
+                                //CV_CALIB_FIX_PRINCIPAL_POINT |
+                                CV_CALIB_FIX_ASPECT_RATIO,
+                                errRGB);
+
+      // keep the errors by frame, so rejected views still show theirs
+      for (size_t v = 0; v < frames.size(); v++)
+        {
+          frameErrIR[frames[v]] = errIR[v];
+          frameErrRGB[frames[v]] = errRGB[v];
+        }
+
+      if (pass > 0 || max_err <= 0.0)
+        break;
 
-  // Monocular calibration of depth camera
-  Mat camMatrix;
-  Mat distCoeffs;
-  vector<Mat> rvecs;
-  vector<Mat> tvecs;
-  double rp_err;
-  // Currently assuming zero distortion
-  rp_err = calibrateCamera(pats, points, Size(COLS,ROWS), camMatrix, distCoeffs,
-                           rvecs, tvecs,
-                           CV_CALIB_FIX_K3 | 
-                           CV_CALIB_FIX_K2 | 
-                           CV_CALIB_FIX_K1 | 
-                           CV_CALIB_ZERO_TANGENT_DIST |
-                           //CV_CALIB_FIX_PRINCIPAL_POINT |
-                           CV_CALIB_FIX_ASPECT_RATIO
-                          );
-
-  printf("\nCalibration results:\n");
+      vector<int> inliers;
+      for (size_t v = 0; v < frames.size(); v++)
+        {
+          if (errIR[v] <= max_err && errRGB[v] <= max_err)
+            inliers.push_back(frames[v]);
+          else
+            status[frames[v]] = "rejected, reprojection error too big";
+        }
+      if (inliers.size() == frames.size())
+        break;
+      if (inliers.size() < 3)
+        {
+          fprintf(log, "*** Only %d views under the error limit, keeping them all\n", (int)inliers.size());
+          for (size_t v = 0; v < frames.size(); v++)
+            status[frames[v]] = "ok";
+          break;
+        }
+      fprintf(log, "Rejected %d views with reprojection error over %f, calibrating again\n",
+                   (int)(frames.size() - inliers.size()), max_err);
+      frames = inliers;
+      result.nviews = frames.size();
+    }
+
+  // per-view report, in frame order
+  fprintf(log, "\nView  IR error  RGB error  status\n");
+  for (fnum = 0; fnum < nframes; fnum++)
+    {
+      if (frameErrIR[fnum] < 0)
+        fprintf(log, "%4d  %8s  %9s  %s\n", fnum, "-", "-", status[fnum].c_str());
+      else
+        fprintf(log, "%4d  %8.4f  %9.4f  %s\n", fnum, frameErrIR[fnum], frameErrRGB[fnum], status[fnum].c_str());
+    }
+
+  fprintf(log, "\nCalibration results:\n");
 
   // print camera matrix
-  printf("\nCamera matrix\n");
+  fprintf(log, "\nCamera matrix\n");
   double *dptr = camMatrix.ptr<double>(0);
   for (int i=0; i<3; i++)
     {
       for (int j=0; j<3; j++)
-        printf("%f ",*dptr++);
-      printf("\n");
+        fprintf(log, "%f ",*dptr++);
+      fprintf(log, "\n");
     }
-  //printf("\nAssuming zero distortion\n");
+  //fprintf(log, "\nAssuming zero distortion\n");
   dptr = distCoeffs.ptr<double>(0);
-  printf("\nDistortion coefficients:\n"
-         "k1: %f\n"
-         "k2: %f\n"
-         "t1: %f\n"
-         "t2: %f\n"
-         "k3: %f\n", dptr[0], dptr[1], dptr[2], dptr[3], dptr[4]);
+  fprintf(log, "\nDistortion coefficients:\n"
+               "k1: %f\n"
+               "k2: %f\n"
+               "t1: %f\n"
+               "t2: %f\n"
+               "k3: %f\n", dptr[0], dptr[1], dptr[2], dptr[3], dptr[4]);
   
-  printf("\nReprojection error = %f\n\n", rp_err);
+  fprintf(log, "\nReprojection error = %f\n\n", rp_err);
 
   char depth_fname[1024];
   sprintf(depth_fname, "%s/calibration_depth.yaml", fdir);
   FILE *depth_file = fopen(depth_fname, "w");
   if (depth_file) {
     writeCalibration(depth_file, camMatrix, distCoeffs);
-    printf("Wrote depth camera calibration to %s\n\n", depth_fname);
+    fclose(depth_file);
+    fprintf(log, "Wrote depth camera calibration to %s\n\n", depth_fname);
   }
   
   // Read in depth images, fit readings to computed depths
-  /// @todo Not checking that we actually got depth readings!
-  fnum = 0;
   std::vector<cv::Vec2d> ls_src1;
   std::vector<double> ls_src2;
-  //printf("Z\tr\n");
-  while (1)
+  //fprintf(log, "Z\tr\n");
+  for (size_t v = 0; v < frames.size(); v++)
     {
-      // Load raw depth readings
-      char fname[1024];
-      sprintf(fname,"%s/img_depth_%02d.png",fdir,fnum);
-      Mat img_depth = imread(fname,-1);
-      if (img_depth.data == NULL) break; // no data, not read, break out
+      // Raw depth readings
+      Mat &img_depth = depthViews[frames[v]].img;
 
       // Get corner points and extrinsic parameters
-      const cv::Mat pattern(pats[fnum]); // 3-channel matrix view of vector<Point3f>
-      vector<Point2f> &corners = points[fnum];
-      cv::Mat rvec = rvecs[fnum];
-      cv::Mat tvec = tvecs[fnum];
+      const cv::Mat pattern(pats[v]); // 3-channel matrix view of vector<Point3f>
+      vector<Point2f> &corners = points[v];
+      cv::Mat rvec = rvecs[v];
+      cv::Mat tvec = tvecs[v];
       cv::Mat rot3x3;
       cv::Rodrigues(rvec, rot3x3);
 
@@ -323,12 +689,12 @@ main(int argc, char **argv)
       for (int j = 0; j < corners.size(); ++j) {
         double Z = world_points.at<cv::Vec3f>(j)[2];   // actual depth
         double r = img_depth.at<uint16_t>(corners[j]); // sensor reading
+        if (r >= 2047)
+          continue;             // no reading at this corner
         ls_src1.push_back(cv::Vec2d(-1.0, Z));
         ls_src2.push_back(Z*r);
-        //printf("%.4f\t%.0f\n", Z, r);
+        //fprintf(log, "%.4f\t%.0f\n", Z, r);
       }
-
-      fnum++;
     }
 
   cv::Mat depth_params;
@@ -340,148 +706,159 @@ main(int argc, char **argv)
     B = depth_params.at<double>(1);
     double f = camMatrix.ptr<double>()[0];
     b = SHIFT_SCALE * A / f;
-    printf("Reading to depth fitting parameters:\n"
-           "A = %f\n"
-           "B = %f\n"
-           "Baseline between projector and depth camera = %f\n",
-           A, B, b);
+    fprintf(log, "Reading to depth fitting parameters:\n"
+                 "A = %f\n"
+                 "B = %f\n"
+                 "Baseline between projector and depth camera = %f\n",
+                 A, B, b);
   }
   else {
-    printf("**** Failed to solve least-squared problem ****\n");
+    fprintf(log, "**** Failed to solve least-squared problem ****\n");
     return 1;
   }
 
-  // 
-  // calibrate IR to RGB images
-  //
+  kinect_calibration::ShiftLUT lut(B, b, camMatrix.ptr<double>(0)[0]);
 
-  // read in rgb files
-  fnum = 0;
-  vector<vector<Point2f> > pointsRGB; // RGB corners
-  printf("\n");
-  while (1)
+  // Dense depth correction: every depth pixel inside the corners of each
+  // board, against the depth of the board plane along its ray
+  if (opt.correction_tile > 0)
     {
-      char fname[1024];
-      sprintf(fname,"%s/img_rgb_%02d.png",fdir,fnum);
-      Mat img = imread(fname,1);
-      if (img.data == NULL) break; // no data, not read, break out
-
-      vector<cv::Point2f> corners;
-      bool ret = cv::findChessboardCorners(img,Size(crows,ccols),corners);
-
-      if (ret)
-        printf("Found corners in image %s\n",fname);
-      else {
-        printf("*** Didn't find corners in image %s\n",fname);
-        return 1;
-      }
-
-      Mat gray;
-      cv::cvtColor(img, gray, CV_RGB2GRAY);
-      cv::cornerSubPix(gray, corners, Size(5,5), Size(-1,-1),
-                       TermCriteria(TermCriteria::MAX_ITER+TermCriteria::EPS, 30, 0.1));
-
-      pointsRGB.push_back(corners);
-
-      fnum++;
+      kinect_calibration::DepthCorrectionFit fit(ROWS, COLS, opt.correction_tile);
+      const double *K = camMatrix.ptr<double>(0);
+      for (size_t v = 0; v < frames.size(); v++)
+        {
+          Mat &img_depth = depthViews[frames[v]].img;
+          vector<Point2f> &corners = points[v];
+
+          // board plane n.X = n.t in camera coordinates
+          cv::Mat rot3x3;
+          cv::Rodrigues(rvecs[v], rot3x3);
+          cv::Mat normal = rot3x3.col(2);
+          cv::Mat tvec = tvecs[v].reshape(1,3);
+          double nx = normal.at<double>(0), ny = normal.at<double>(1), nz = normal.at<double>(2);
+          double nt = normal.dot(tvec);
+
+          // the outer corners, in order around the board
+          int nc = corners.size();
+          cv::Point quad[4] = { corners[0], corners[crows-1], corners[nc-1], corners[nc-crows] };
+          Mat mask = Mat::zeros(ROWS, COLS, CV_8UC1);
+          cv::fillConvexPoly(mask, quad, 4, Scalar(255));
+
+          for (int y = 0; y < ROWS; y++)
+            {
+              const uint8_t *mptr = mask.ptr<uint8_t>(y);
+              const uint16_t *rptr = img_depth.ptr<uint16_t>(y);
+              for (int x = 0; x < COLS; x++)
+                {
+                  // the LUT only covers 11-bit shifts; anything above isn't one
+                  if (!mptr[x] || rptr[x] > 2047 || !lut.valid[rptr[x]])
+                    continue;
+                  double rx = (x - K[2]) / K[0], ry = (y - K[5]) / K[4];
+                  double Z = nt / (nx*rx + ny*ry + nz);
+                  double z = lut.depth[rptr[x]];
+                  if (fabs(z - Z) > 0.1*Z)
+                    continue;   // a hole or the board's edge
+                  fit.add(x, y, z, Z);
+                }
+            }
+        }
+
+      kinect_calibration::DepthCorrection correction;
+      int ntiles = fit.solve(correction);
+      fprintf(log, "\nDense depth correction from %ld pixels, %d of %d tiles fitted\n"
+                   "RMS depth error %.4f m before, %.4f m after\n",
+                   fit.samples(), ntiles, correction.tile_rows*correction.tile_cols,
+                   fit.rms(kinect_calibration::DepthCorrection(ROWS, COLS, opt.correction_tile)),
+                   fit.rms(correction));
+      char correction_fname[1024];
+      sprintf(correction_fname, "%s/depth_correction.yaml", fdir);
+      if (correction.save(correction_fname))
+        fprintf(log, "Wrote depth correction to %s\n", correction_fname);
     }
 
-  // calibrate monocular camera
-  Mat camMatrixRGB;
-  Mat distCoeffsRGB = Mat::zeros(5,1,CV_64F);
-  // initialize camera matrix
-  camMatrixRGB = (Mat_<double>(3,3) << 1, 0, 320, 0, 1, 240, 0, 0, 1);
-
-  rp_err = calibrateCamera(pats, pointsRGB, Size(COLS,ROWS), camMatrixRGB, distCoeffsRGB,
-                           rvecs, tvecs,
-                           //CV_CALIB_FIX_K1 |
-                           //CV_CALIB_FIX_K2 |
-                           CV_CALIB_FIX_K3 |
-                           CV_CALIB_ZERO_TANGENT_DIST |
-                           //CV_CALIB_FIX_PRINCIPAL_POINT |
-                           CV_CALIB_FIX_ASPECT_RATIO
-                          );
+  // 
+  // calibrate IR to RGB images
+  //
+
+  // the RGB camera was calibrated along with the depth camera
+  fprintf(log, "\n");
 
   // distortion results
-  printf("\nCalibration results:\n");
+  fprintf(log, "\nCalibration results:\n");
 
   // print camera matrix
-  printf("\nCamera matrix\n");
+  fprintf(log, "\nCamera matrix\n");
   dptr = camMatrixRGB.ptr<double>(0);
   for (int i=0; i<3; i++)
     {
       for (int j=0; j<3; j++)
-        printf("%f ",*dptr++);
-      printf("\n");
+        fprintf(log, "%f ",*dptr++);
+      fprintf(log, "\n");
     }
 
   dptr = distCoeffsRGB.ptr<double>(0);
-  printf("\nDistortion coefficients:\n"
-         "k1: %f\n"
-         "k2: %f\n"
-         "t1: %f\n"
-         "t2: %f\n"
-         "k3: %f\n", dptr[0], dptr[1], dptr[2], dptr[3], dptr[4]);
+  fprintf(log, "\nDistortion coefficients:\n"
+               "k1: %f\n"
+               "k2: %f\n"
+               "t1: %f\n"
+               "t2: %f\n"
+               "k3: %f\n", dptr[0], dptr[1], dptr[2], dptr[3], dptr[4]);
   
-  printf("\nReprojection error = %f\n\n", rp_err);
+  fprintf(log, "\nReprojection error = %f\n\n", rp_errRGB);
 
   char rgb_fname[1024];
   sprintf(rgb_fname, "%s/calibration_rgb.yaml", fdir);
   FILE *rgb_file = fopen(rgb_fname, "w");
   if (rgb_file) {
     writeCalibration(rgb_file, camMatrixRGB, distCoeffsRGB);
-    printf("Wrote RGB camera calibration to %s\n\n", rgb_fname);
+    fclose(rgb_file);
+    fprintf(log, "Wrote RGB camera calibration to %s\n\n", rgb_fname);
   }
 
   // stereo calibration between IR and RGB
   Mat R,T,E,F;
-  rp_err = stereoCalibrate(pats,points,pointsRGB,camMatrix,distCoeffs,
-                           camMatrixRGB,distCoeffsRGB,Size(crows,ccols),
-                           R,T,E,F);
+  double rp_errStereo = stereoCalibrate(pats,points,pointsRGB,camMatrix,distCoeffs,
+                                        camMatrixRGB,distCoeffsRGB,Size(crows,ccols),
+                                        R,T,E,F);
   
   dptr = T.ptr<double>(0);
-  printf("\nTranslation between depth and RGB sensors (m):\n");
+  fprintf(log, "\nTranslation between depth and RGB sensors (m):\n");
   for (int i=0; i<3; i++)
-    printf("%f ",dptr[i]);
-  printf("\n");
+    fprintf(log, "%f ",dptr[i]);
+  fprintf(log, "\n");
 
-  printf("\nRotation matrix:\n");
+  fprintf(log, "\nRotation matrix:\n");
   dptr = R.ptr<double>(0);
   for (int i=0; i<3; i++)
     {
       for (int j=0; j<3; j++)
-        printf("%f ",*dptr++);
-      printf("\n");
+        fprintf(log, "%f ",*dptr++);
+      fprintf(log, "\n");
     }
-  printf("\nReprojection error = %f\n\n", rp_err);
-
-
-  Matrix4d Q,S;                 // transformations
-  Matrix<double,3,4> P;         // projection
-
-  // from u,v,d of depth camera to XYZ
-  double *cptr = camMatrix.ptr<double>(0);
-  Q << 1, 0, 0,    -cptr[2],  // -cx
-       0, 1, 0,    -cptr[5],  // -cy
-       0, 0, 0,     cptr[0],  // focal length
-       0, 0, 1.0/b, 0;        // baseline
-
-  // from XYZ of depth camera to XYZ of RGB camera
-  dptr = R.ptr<double>(0);
-  double *tptr = T.ptr<double>(0);
-  S << dptr[0], dptr[1], dptr[2], tptr[0],
-       dptr[3], dptr[4], dptr[5], tptr[1],
-       dptr[6], dptr[7], dptr[8], tptr[2],
-       0,       0,       0,       1;
-
-  // from XYZ to u,v in RGB camera
-  cptr = camMatrixRGB.ptr<double>(0);
-  P << cptr[0], 0,       cptr[2], 0,
-       0,       cptr[4], cptr[5], 0,
-       0,       0,       1,       0;
-
-  Matrix<double,3,4> D = P*S*Q;
-  std::cout << "Transform matrix:" << std::endl << D << std::endl << std::endl;
+  fprintf(log, "\nReprojection error = %f\n\n", rp_errStereo);
+
+  result.err_depth = rp_err;
+  result.err_rgb = rp_errRGB;
+  result.err_stereo = rp_errStereo;
+  result.baseline = b;
+  result.shift_offset = B;
+
+  // same transform the registration library builds from the saved files
+  kinect_calibration::KinectParams params;
+  memcpy(params.depth_K, camMatrix.ptr<double>(0), 9*sizeof(double));
+  memcpy(params.depth_D, distCoeffs.ptr<double>(0), 5*sizeof(double));
+  memcpy(params.rgb_K, camMatrixRGB.ptr<double>(0), 9*sizeof(double));
+  memcpy(params.rgb_D, distCoeffsRGB.ptr<double>(0), 5*sizeof(double));
+  memcpy(params.R, R.ptr<double>(0), 9*sizeof(double));
+  memcpy(params.T, T.ptr<double>(0), 3*sizeof(double));
+  params.shift_offset = B;
+  params.baseline = b;
+
+  Matrix<double,3,4> D = params.depthToRgb();
+  fprintf(log, "Transform matrix:\n");
+  for (int i=0; i<3; i++)
+    fprintf(log, "%f %f %f %f\n", D(i,0), D(i,1), D(i,2), D(i,3));
+  fprintf(log, "\n");
 
   char params_fname[1024];
   sprintf(params_fname, "%s/kinect_params.yaml", fdir);
@@ -496,97 +873,355 @@ main(int argc, char **argv)
     dptr = T.ptr<double>(0);
     fprintf(params_file,
             "depth_rgb_translation: [ %.6f, %.6f, %.6f ]\n", dptr[0], dptr[1], dptr[2]);
-    printf("Wrote additional calibration parameters to %s\n", params_fname);
+    fclose(params_file);
+    fprintf(log, "Wrote additional calibration parameters to %s\n", params_fname);
   }
   
   //
   // create rectified disparity images and save
   //
 
-  // set up gamma for depth colorizer
-  for (int i = 0; i < 2048; i++)
-  {
-    float v = i / 2048.0;
-    v = powf (v, 3) * 6;
-    t_gamma[i] = v * 6 * 256;
-  }
+  int diag = opt.diagnostics;
+  if (!diag)
+    {
+      result.ok = true;
+      return 0;
+    }
 
+  kinect_calibration::DepthRegistration registration(D, lut, ROWS, COLS);
+  kinect_calibration::ImageWriter writer(opt.nthreads);
+  kinect_calibration::DepthColorizer colorizer(kinect_calibration::DepthColorizer::BGR);
+  bool need_rgb = diag & (DIAG_RGB_MAPPED | DIAG_RGB_RECT);
+  bool need_reg = diag & (DIAG_DEPTH_RECT | DIAG_DEPTH_RECT_COLOR | DIAG_RGB_MAPPED);
 
-  fnum = 0;
-  printf("Creating output images\n");
-  while (1)
+  // the depth and RGB images were loaded with the views
+  fprintf(log, "Creating output images\n");
+  for (fnum = 0; fnum < ndepth; fnum++)
     {
       char fname[1024];
-      sprintf(fname,"%s/img_depth_%02d.png",fdir,fnum);
-      Mat img = imread(fname,-1);
+      Mat &img = depthViews[fnum].img;
       if (img.data == NULL) break; // no data, not read, break out
 
-      sprintf(fname,"%s/img_rgb_%02d.png",fdir,fnum);
-      Mat imgRGB = imread(fname,1);
-      if (imgRGB.data == NULL) break; // no data, not read, break out
-
       // Rectify RGB image
       cv::Mat imgRgbRect;
-      cv::undistort(imgRGB, imgRgbRect, camMatrixRGB, distCoeffsRGB);
+      if (need_rgb)
+        {
+          if (fnum >= nrgb || rgbViews[fnum].img.data == NULL)
+            break;              // no data, not read, break out
+          cv::undistort(rgbViews[fnum].img, imgRgbRect, camMatrixRGB, distCoeffsRGB);
+        }
 
       uint16_t *dptr = img.ptr<uint16_t>(0);
 
-      Mat imgr  = Mat::zeros(ROWS,COLS,CV_16UC1); // depth image mapped to RGB image
-      Mat imgrc = Mat::zeros(ROWS,COLS,CV_8UC3); // depth image mapped to RGB image, colorized
-      Mat imgc  = Mat::zeros(ROWS,COLS,CV_8UC3); // original depth image colorized
-      Mat imgdc = Mat::zeros(ROWS,COLS,CV_8UC3); // RGB mapped to depth image
+      // only the images asked for are allocated and filled in
+      Mat imgr, imgrc, imgc, imgdc, imgrs;
+      if (diag & DIAG_DEPTH_RECT)
+        imgr  = Mat::zeros(ROWS,COLS,CV_16UC1); // depth image mapped to RGB image
+      if (diag & DIAG_DEPTH_RECT_COLOR)
+        {
+          imgrc.create(ROWS,COLS,CV_8UC3); // depth image mapped to RGB image, colorized
+          imgrs.create(ROWS,COLS,CV_16UC1); // raw shift of the depth pixel that won each RGB pixel
+        }
+      if (diag & DIAG_DEPTH_COLOR)
+        imgc.create(ROWS,COLS,CV_8UC3); // original depth image colorized
+      if (diag & DIAG_RGB_MAPPED)
+        imgdc = Mat::zeros(ROWS,COLS,CV_8UC3); // RGB mapped to depth image
+
+      uint16_t *rptr = imgr.data ? imgr.ptr<uint16_t>(0) : NULL;
+      uint16_t *rsptr = imgrs.data ? imgrs.ptr<uint16_t>(0) : NULL;
+      uint8_t *rcptr = imgrc.data ? imgrc.ptr<uint8_t>(0) : NULL;
+      uint8_t *cptr  = imgc.data ? imgc.ptr<uint8_t>(0) : NULL;
+      uint8_t *dcptr = imgdc.data ? imgdc.ptr<uint8_t>(0) : NULL;
+      uint8_t *rgbptr = imgRgbRect.data ? imgRgbRect.ptr<uint8_t>(0) : NULL;
+
+      if (need_reg)
+        registration.registerDepth(dptr, rgbptr, rptr, rsptr, dcptr, opt.nthreads);
+
+      // RGB pixels nothing landed on have shift 2047, which is black
+      if (cptr)
+        colorizer.colorize(dptr, cptr, ROWS*COLS);
+      if (rcptr)
+        colorizer.colorize(rsptr, rcptr, ROWS*COLS);
+
+      // encoded and written in the background
+      if (diag & DIAG_DEPTH_RECT)
+        {
+          sprintf(fname,"%s/img_depth_rect_%02d.png",fdir,fnum);
+          fprintf(log, "Writing %s\n", fname);
+          writer.write(fname,imgr);
+        }
+      if (diag & DIAG_DEPTH_RECT_COLOR)
+        {
+          sprintf(fname,"%s/img_depth_rect_color_%02d.png",fdir,fnum);
+          fprintf(log, "Writing %s\n", fname);
+          writer.write(fname,imgrc);
+        }
+      if (diag & DIAG_DEPTH_COLOR)
+        {
+          sprintf(fname,"%s/img_depth_color_%02d.png",fdir,fnum);
+          fprintf(log, "Writing %s\n", fname);
+          writer.write(fname,imgc);
+        }
+      if (diag & DIAG_RGB_MAPPED)
+        {
+          sprintf(fname,"%s/img_rgb_mapped_%02d.png",fdir,fnum);
+          fprintf(log, "Writing %s\n", fname);
+          writer.write(fname,imgdc);
+        }
+      if (diag & DIAG_RGB_RECT)
+        {
+          sprintf(fname,"%s/img_rgb_rect_%02d.png",fdir,fnum);
+          fprintf(log, "Writing %s\n", fname);
+          writer.write(fname,imgRgbRect);
+        }
+    }
+
+  writer.flush();
+  if (writer.failed())
+    fprintf(log, "*** %d output images could not be written\n", writer.failed());
+
+  result.ok = true;
+  return 0;
+}
+
+static double now()
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec/1000000.0;
+}
+
+// the directories of a batch run
+struct BatchJob
+{
+  const CalibOptions *opt;
+  vector<string> *dirs;
+  vector<CalibResult> *results;
+};
+
+// parallelFor body for batch mode: calibrates one directory, logging to
+// calibrate.log in that directory
+void calibrateBatchDir(int i, void *arg)
+{
+  BatchJob *job = (BatchJob *)arg;
+  const char *fdir = (*job->dirs)[i].c_str();
+  CalibResult &result = (*job->results)[i];
+  memset(&result, 0, sizeof(result));
+
+  char log_fname[1024];
+  sprintf(log_fname, "%s/calibrate.log", fdir);
+  FILE *log = fopen(log_fname, "w");
+  if (!log)
+    {
+      printf("*** Could not write %s\n", log_fname);
+      return;
+    }
+  double t0 = now();
+  // one bad directory (too few views for OpenCV, say) mustn't take the
+  // rest of the batch down with it
+  try
+    {
+      calibrateDirectory(*job->opt, fdir, log, result);
+    }
+  catch (cv::Exception &e)
+    {
+      fprintf(log, "*** OpenCV error: %s\n", e.what());
+      result.ok = false;
+    }
+  catch (std::exception &e)
+    {
+      fprintf(log, "*** Error: %s\n", e.what());
+      result.ok = false;
+    }
+  result.seconds = now() - t0;
+  fclose(log);
+  printf("%s %s: %d views, %.1f s\n", result.ok ? "Calibrated" : "*** Failed to calibrate",
+         fdir, result.nviews, result.seconds);
+}
+
+// a field of the summary, quoted if it has a comma or quote in it
+static string csvField(const string &s)
+{
+  if (s.find_first_of(",\"\n") == string::npos)
+    return s;
+  string q = "\"";
+  for (size_t i = 0; i < s.size(); i++)
+    {
+      if (s[i] == '"') q += '"';
+      q += s[i];
+    }
+  return q + "\"";
+}
+
+// Calibrates every directory listed in the manifest (one per line, lines
+// starting with # are skipped), njobs at a time, and writes a line per
+// directory to the summary file.  Returns 1 if any of them failed.
+int
+calibrateBatch(CalibOptions opt, const char *manifest, int njobs, const char *summary_fname)
+{
+  FILE *f = fopen(manifest, "r");
+  if (!f)
+    {
+      printf("*** Could not read manifest %s\n", manifest);
+      return 1;
+    }
+  vector<string> dirs;
+  char line[1024], dir[1024];
+  while (fgets(line, sizeof(line), f))
+    if (line[0] != '#' && sscanf(line, "%1023s", dir) == 1)
+      dirs.push_back(dir);
+  fclose(f);
+
+  // share the cores between the directories being calibrated at once
+  int ncores = kinect_calibration::defaultThreads();
+  if (njobs <= 0) njobs = ncores;
+  if (opt.nthreads <= 0)
+    opt.nthreads = max(1, ncores / njobs);
+
+  vector<CalibResult> results(dirs.size());
+  BatchJob job;
+  job.opt = &opt;
+  job.dirs = &dirs;
+  job.results = &results;
+  double t0 = now();
+  kinect_calibration::parallelFor(dirs.size(), calibrateBatchDir, &job, njobs);
+
+  FILE *summary = fopen(summary_fname, "w");
+  if (!summary)
+    {
+      printf("*** Could not write %s\n", summary_fname);
+      return 1;
+    }
+  fprintf(summary, "dir,status,views,frames,depth_error,rgb_error,stereo_error,baseline,shift_offset,seconds\n");
+  int nfailed = 0;
+  for (size_t i = 0; i < dirs.size(); i++)
+    {
+      const CalibResult &r = results[i];
+      if (!r.ok) nfailed++;
+      fprintf(summary, "%s,%s,%d,%d,%f,%f,%f,%f,%.4f,%.1f\n",
+              csvField(dirs[i]).c_str(), r.ok ? "ok" : "failed", r.nviews, r.nframes,
+              r.err_depth, r.err_rgb, r.err_stereo, r.baseline, r.shift_offset, r.seconds);
+    }
+  fclose(summary);
+  printf("Calibrated %d of %d directories in %.1f s, wrote %s\n",
+         (int)dirs.size() - nfailed, (int)dirs.size(), now() - t0, summary_fname);
+  return nfailed ? 1 : 0;
+}
 
-      uint16_t *rptr = imgr.ptr<uint16_t>(0);
-      uint8_t *rcptr = imgrc.ptr<uint8_t>(0);
-      uint8_t *cptr  = imgc.ptr<uint8_t>(0);
-      uint8_t *dcptr = imgdc.ptr<uint8_t>(0);
-      uint8_t *rgbptr = imgRgbRect.ptr<uint8_t>(0);
+//
+// arguments:
+//   [dir]          data directory (without trailing slash); default cwd
+//   [cell size, m] size of edge of each square in chessboard
+//   [#rows #cols]  number of rows and cols of interior chessboard;
+//                  default 6x7
+//   -m manifest    calibrate each directory listed in manifest instead,
+//                  logging to calibrate.log in each
+//   -j jobs        directories to calibrate at once; default one per core
+//   -t threads     threads per directory; default shares the cores
+//   -o summary     batch summary; default calibration_summary.csv
+//   -f             find every chessboard again, instead of using
+//                  corners.cache; overrides -i
+//   -i             start from the last calibration in the directory, so
+//                  a few added views only nudge it
+//   -d tile        also fit a per-tile depth correction from every board
+//                  pixel, with tile x tile pixel tiles (16 is a good start)
+//   -w images      diagnostic images to write for each frame: a comma-
+//                  separated list of depth_rect, depth_rect_color,
+//                  depth_color, rgb_mapped, rgb_rect, all (the default),
+//                  or none to write only the calibration parameters
+//
+
+int
+main(int argc, char **argv)
+{
+  CalibOptions opt;
+  opt.crows = 0;
+  opt.ccols = 0;
+  opt.csize = 0.0;
+  opt.max_err = 0.0;
+  opt.nthreads = 0;
+  opt.use_cache = true;
+  opt.warm_start = false;
+  opt.correction_tile = 0;
+  opt.diagnostics = DIAG_ALL;
+  char *fdir = NULL;
+  char *manifest = NULL;
+  int njobs = 0;
+  const char *summary = "calibration_summary.csv";
 
-      int k=0;
-      for (int i=0; i<ROWS; i++)
-        for (int j=0; j<COLS; j++,k++) // k is depth image index
+  bool fresh = false;
+  opterr = 0;
+  int c;
+  while ((c = getopt(argc, argv, "r:c:s:e:m:j:t:o:fid:w:")) != -1)
+  {
+    switch (c)
+    {
+      case 'r':
+        opt.crows = atoi(optarg);
+        break;
+      case 'c':
+        opt.ccols = atoi(optarg);
+        break;
+      case 's':
+        opt.csize = atof(optarg);
+        break;
+      case 'e':
+        opt.max_err = atof(optarg);
+        break;
+      case 'm':
+        manifest = optarg;
+        break;
+      case 'j':
+        njobs = atoi(optarg);
+        break;
+      case 't':
+        opt.nthreads = atoi(optarg);
+        break;
+      case 'o':
+        summary = optarg;
+        break;
+      case 'f':
+        fresh = true;
+        break;
+      case 'i':
+        opt.warm_start = true;
+        break;
+      case 'd':
+        opt.correction_tile = atoi(optarg);
+        break;
+      case 'w':
+        opt.diagnostics = parseDiagnostics(optarg);
+        if (opt.diagnostics < 0)
           {
-            double d = shift2disp(dptr[k], B);
-            if (d <= 0)
-              d = 0.0;          // not valid
-            Vector4d p;
-            p << j,i,d,1;
-            Vector3d q;
-            q = D*p;
-            int u = (int)(q[0]/q[2]+0.5);
-            int v = (int)(q[1]/q[2]+0.5);
-            setDepthColor(&cptr[3*(i*COLS+j)],dptr[k]);
-            if (u < 0 || v < 0 || u >= COLS || v >= ROWS)
-              continue;
-            int disp = (int)(d*16+0.499);
-            int kk = v*COLS+u;  // kk is corresponding RGB image index
-            if (rptr[kk] < disp) // z-buffer check
-              {
-                rptr[kk] = disp;
-                setDepthColor(&rcptr[3*kk],dptr[k]);
-              }
-            if (d != 0.0)
-              memcpy(&dcptr[3*k],&rgbptr[3*kk],3); // RGB mapped to depth image
+            printf("Unknown diagnostic image in \"%s\"; use a comma-separated list of\n"
+                   "depth_rect, depth_rect_color, depth_color, rgb_mapped, rgb_rect, all or none\n",
+                   optarg);
+            return 1;
           }
-
-      sprintf(fname,"%s/img_depth_rect_%02d.png",fdir,fnum);
-      printf("Writing %s\n", fname);
-      imwrite(fname,imgr);
-      sprintf(fname,"%s/img_depth_rect_color_%02d.png",fdir,fnum);
-      printf("Writing %s\n", fname);
-      imwrite(fname,imgrc);
-      sprintf(fname,"%s/img_depth_color_%02d.png",fdir,fnum);
-      printf("Writing %s\n", fname);
-      imwrite(fname,imgc);
-      sprintf(fname,"%s/img_rgb_mapped_%02d.png",fdir,fnum);
-      printf("Writing %s\n", fname);
-      imwrite(fname,imgdc);
-      sprintf(fname,"%s/img_rgb_rect_%02d.png",fdir,fnum);
-      printf("Writing %s\n", fname);
-      imwrite(fname,imgRgbRect);
-
-      fnum++;
+        break;
     }
+  }
 
-  return 0;
+  if (optind < argc)
+    fdir = argv[optind];
+
+  // -f is a fresh calibration, from scratch
+  if (fresh)
+    opt.use_cache = opt.warm_start = false;
+
+  if (opt.crows == 0 || opt.ccols == 0 || opt.csize == 0.0 || (fdir == NULL && manifest == NULL))
+  {
+    printf("Must give the checkerboard dimensions and data directory.\n"
+           "Usage:\n"
+           "%s -r ROWS -c COLS -s SQUARE_SIZE [-e MAX_VIEW_ERROR] [-t THREADS] [-f] [-i] [-d TILE] [-w IMAGES] my_data_dir\n"
+           "%s -r ROWS -c COLS -s SQUARE_SIZE [-e MAX_VIEW_ERROR] [-t THREADS] [-f] [-i] [-d TILE] [-w IMAGES] -m MANIFEST [-j JOBS] [-o SUMMARY.csv]\n",
+           argv[0], argv[0]);
+    return 1;
+  }
+
+  if (manifest)
+    return calibrateBatch(opt, manifest, njobs, summary);
+
+  CalibResult result;
+  return calibrateDirectory(opt, fdir, stdout, result);
 }
@@ -0,0 +1,100 @@
+/*********************************************************************
+* Software License Agreement (BSD License)
+*
+*  Copyright (c) 2009, Willow Garage, Inc.
+*  All rights reserved.
+*
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions
+*  are met:
+*
+*   * Redistributions of source code must retain the above copyright
+*     notice, this list of conditions and the following disclaimer.
+*   * Redistributions in binary form must reproduce the above
+*     copyright notice, this list of conditions and the following
+*     disclaimer in the documentation and/or other materials provided
+*     with the distribution.
+*   * Neither the name of the Willow Garage nor the names of its
+*     contributors may be used to endorse or promote products derived
+*     from this software without specific prior written permission.
+*
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+*  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+*  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+*  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+*  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+*  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+*  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+*  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+*  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+*  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+*  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+*  POSSIBILITY OF SUCH DAMAGE.
+*********************************************************************/
+
+
+#include <math.h>
+#include <kinect_calibration/depth_colorizer.h>
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+namespace kinect_calibration
+{
+
+DepthColorizer::DepthColorizer(Order order)
+{
+  for (int i = 0; i < 2048; i++)
+    {
+      // gamma, then six ramps of 256
+      float v = i / 2048.0;
+      v = powf(v, 3) * 6;
+      int pval = (uint16_t)(v * 6 * 256);
+      int lb = pval & 0xff;
+      int r, g, b;
+      switch (pval >> 8)
+        {
+        case 0:  r = 255;      g = 255 - lb; b = 255 - lb; break;
+        case 1:  r = 255;      g = lb;       b = 0;        break;
+        case 2:  r = 255 - lb; g = 255;      b = 0;        break;
+        case 3:  r = 0;        g = 255;      b = lb;       break;
+        case 4:  r = 0;        g = 255 - lb; b = 255;      break;
+        case 5:  r = 0;        g = 0;        b = 255 - lb; break;
+        default: r = 0;        g = 0;        b = 0;        break;
+        }
+      if (i == 2047)
+        r = g = b = 0;          // no reading
+      if (order == RGB)
+        palette_[i] = r | (g << 8) | (b << 16);
+      else
+        palette_[i] = b | (g << 8) | (r << 16);
+    }
+}
+
+void DepthColorizer::colorize(const uint16_t *shift, uint8_t *out, int n) const
+{
+  int i = 0;
+#ifdef __AVX2__
+  // Gather 8 colors, squeeze each lane's 4 x 4 bytes down to 12, and
+  // store the lanes 12 bytes apart.  Each store writes 4 bytes past its
+  // pixels, which the next store (or the scalar loop) overwrites, so stop
+  // while there are at least 2 pixels to spare.
+  const __m256i mask = _mm256_set1_epi32(2047);
+  const __m256i pack = _mm256_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+                                        0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+  for (; i + 10 <= n; i += 8)
+    {
+      __m256i s = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(shift + i)));
+      s = _mm256_and_si256(s, mask);
+      __m256i c = _mm256_i32gather_epi32((const int *)palette_, s, 4);
+      c = _mm256_shuffle_epi8(c, pack);
+      _mm_storeu_si128((__m128i *)(out + 3*i), _mm256_castsi256_si128(c));
+      _mm_storeu_si128((__m128i *)(out + 3*i + 12), _mm256_extracti128_si256(c, 1));
+    }
+#endif
+  for (; i < n; i++)
+    colorize(shift[i], out + 3*i);
+}
+
+} // namespace kinect_calibration
@@ -0,0 +1,218 @@
+/*********************************************************************
+* Software License Agreement (BSD License)
+*
+*  Copyright (c) 2009, Willow Garage, Inc.
+*  All rights reserved.
+*
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions
+*  are met:
+*
+*   * Redistributions of source code must retain the above copyright
+*     notice, this list of conditions and the following disclaimer.
+*   * Redistributions in binary form must reproduce the above
+*     copyright notice, this list of conditions and the following
+*     disclaimer in the documentation and/or other materials provided
+*     with the distribution.
+*   * Neither the name of the Willow Garage nor the names of its
+*     contributors may be used to endorse or promote products derived
+*     from this software without specific prior written permission.
+*
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+*  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+*  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+*  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+*  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+*  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+*  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+*  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+*  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+*  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+*  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+*  POSSIBILITY OF SUCH DAMAGE.
+*********************************************************************/
+
+
+#include <stdio.h>
+#include <math.h>
+#include <kinect_calibration/depth_correction.h>
+#include <kinect_calibration/kinect_params.h>
+
+namespace kinect_calibration
+{
+
+DepthCorrection::DepthCorrection(int rows, int cols, int tile)
+  : rows(rows), cols(cols), tile(tile)
+{
+  tile_rows = (rows + tile - 1) / tile;
+  tile_cols = (cols + tile - 1) / tile;
+  tile_gain.assign(tile_rows*tile_cols, 1.0f);
+  tile_offset.assign(tile_rows*tile_cols, 0.0f);
+  expand();
+}
+
+void DepthCorrection::expand()
+{
+  gain_.resize(rows*cols);
+  offset_.resize(rows*cols);
+  for (int v = 0; v < rows; v++)
+    for (int u = 0; u < cols; u++)
+      {
+        int t = (v/tile)*tile_cols + u/tile;
+        gain_[v*cols+u] = tile_gain[t];
+        offset_[v*cols+u] = tile_offset[t];
+      }
+}
+
+bool DepthCorrection::load(const std::string &fname)
+{
+  std::string text;
+  if (!readFile(fname, text))
+    return false;
+  double size[5];
+  if (!readValues(text, "image_width", &size[0], 1) ||
+      !readValues(text, "image_height", &size[1], 1) ||
+      !readValues(text, "tile_size", &size[2], 1) ||
+      !readValues(text, "tile_rows", &size[3], 1) ||
+      !readValues(text, "tile_cols", &size[4], 1) ||
+      size[2] < 1 || size[3] != (int)(size[1] + size[2] - 1) / (int)size[2] ||
+      size[4] != (int)(size[0] + size[2] - 1) / (int)size[2])
+    {
+      printf("Bad depth correction file %s\n", fname.c_str());
+      return false;
+    }
+  if (size[0] != cols || size[1] != rows)
+    {
+      printf("Depth correction %s is for %.0fx%.0f images, not %dx%d\n",
+             fname.c_str(), size[0], size[1], cols, rows);
+      return false;
+    }
+
+  int ntiles = (int)size[3] * (int)size[4];
+  std::vector<double> gain(ntiles), offset(ntiles);
+  if (!readValues(text, "gain", &gain[0], ntiles) ||
+      !readValues(text, "offset", &offset[0], ntiles))
+    {
+      printf("Bad depth correction file %s\n", fname.c_str());
+      return false;
+    }
+  tile = size[2];
+  tile_rows = size[3];
+  tile_cols = size[4];
+  tile_gain.assign(gain.begin(), gain.end());
+  tile_offset.assign(offset.begin(), offset.end());
+  expand();
+  return true;
+}
+
+bool DepthCorrection::save(const std::string &fname) const
+{
+  FILE *f = fopen(fname.c_str(), "w");
+  if (!f)
+    return false;
+  fprintf(f, "image_width: %d\n", cols);
+  fprintf(f, "image_height: %d\n", rows);
+  fprintf(f, "tile_size: %d\n", tile);
+  fprintf(f, "tile_rows: %d\n", tile_rows);
+  fprintf(f, "tile_cols: %d\n", tile_cols);
+  // one row of tiles per line
+  const std::vector<float> *tables[2] = { &tile_gain, &tile_offset };
+  const char *names[2] = { "gain", "offset" };
+  for (int k = 0; k < 2; k++)
+    {
+      fprintf(f, "%s: [", names[k]);
+      for (size_t t = 0; t < tables[k]->size(); t++)
+        fprintf(f, "%s%s%.6f", t ? "," : "", t % tile_cols ? " " : "\n   ", (*tables[k])[t]);
+      fprintf(f, " ]\n");
+    }
+  bool ok = !ferror(f);
+  fclose(f);
+  return ok;
+}
+
+void DepthCorrection::apply(float *depth) const
+{
+  const float *gain = &gain_[0];
+  const float *offset = &offset_[0];
+  for (int i = 0; i < rows*cols; i++)
+    {
+      float z = depth[i];
+      depth[i] = z > 0.0f ? gain[i]*z + offset[i] : 0.0f;
+    }
+}
+
+
+DepthCorrectionFit::DepthCorrectionFit(int rows, int cols, int tile)
+  : rows_(rows), cols_(cols), tile_(tile)
+{
+  tile_rows_ = (rows + tile - 1) / tile;
+  tile_cols_ = (cols + tile - 1) / tile;
+  int ntiles = tile_rows_*tile_cols_;
+  n_.assign(ntiles, 0.0);
+  sz_.assign(ntiles, 0.0);
+  szz_.assign(ntiles, 0.0);
+  st_.assign(ntiles, 0.0);
+  szt_.assign(ntiles, 0.0);
+  stt_.assign(ntiles, 0.0);
+}
+
+void DepthCorrectionFit::add(int u, int v, double z, double z_true)
+{
+  if (u < 0 || v < 0 || u >= cols_ || v >= rows_)
+    return;
+  int t = (v/tile_)*tile_cols_ + u/tile_;
+  n_[t] += 1.0;
+  sz_[t] += z;
+  szz_[t] += z*z;
+  st_[t] += z_true;
+  szt_[t] += z*z_true;
+  stt_[t] += z_true*z_true;
+}
+
+int DepthCorrectionFit::solve(DepthCorrection &corr, int min_samples, double lambda) const
+{
+  corr = DepthCorrection(rows_, cols_, tile_);
+  int nfit = 0;
+  for (size_t t = 0; t < n_.size(); t++)
+    {
+      if (n_[t] < min_samples)
+        continue;
+      // Normal equations of sum (gain*z + offset - z_true)^2, plus
+      // lambda*(zm*(gain-1))^2 + lambda*offset^2 towards the identity
+      double zm = sz_[t] / n_[t];
+      double a = szz_[t] + lambda*zm*zm, b = sz_[t], d = n_[t] + lambda;
+      double r0 = szt_[t] + lambda*zm*zm, r1 = st_[t];
+      double det = a*d - b*b;
+      if (fabs(det) < 1e-12)
+        continue;
+      corr.tile_gain[t] = (d*r0 - b*r1) / det;
+      corr.tile_offset[t] = (a*r1 - b*r0) / det;
+      nfit++;
+    }
+  corr.expand();
+  return nfit;
+}
+
+double DepthCorrectionFit::rms(const DepthCorrection &corr) const
+{
+  // sum (g*z + o - t)^2 expanded in terms of the sums we kept
+  double sum = 0.0, n = 0.0;
+  for (size_t t = 0; t < n_.size(); t++)
+    {
+      double g = corr.tile_gain[t], o = corr.tile_offset[t];
+      sum += g*g*szz_[t] + o*o*n_[t] + stt_[t]
+        + 2*g*o*sz_[t] - 2*g*szt_[t] - 2*o*st_[t];
+      n += n_[t];
+    }
+  return n > 0 ? sqrt(fmax(sum, 0.0) / n) : 0.0;
+}
+
+long DepthCorrectionFit::samples() const
+{
+  double n = 0.0;
+  for (size_t t = 0; t < n_.size(); t++)
+    n += n_[t];
+  return (long)n;
+}
+
+} // namespace kinect_calibration
@@ -0,0 +1,449 @@
+/*********************************************************************
+* Software License Agreement (BSD License)
+*
+*  Copyright (c) 2009, Willow Garage, Inc.
+*  All rights reserved.
+*
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions
+*  are met:
+*
+*   * Redistributions of source code must retain the above copyright
+*     notice, this list of conditions and the following disclaimer.
+*   * Redistributions in binary form must reproduce the above
+*     copyright notice, this list of conditions and the following
+*     disclaimer in the documentation and/or other materials provided
+*     with the distribution.
+*   * Neither the name of the Willow Garage nor the names of its
+*     contributors may be used to endorse or promote products derived
+*     from this software without specific prior written permission.
+*
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+*  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+*  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+*  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+*  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+*  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+*  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+*  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+*  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+*  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+*  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+*  POSSIBILITY OF SUCH DAMAGE.
+*********************************************************************/
+
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <kinect_calibration/frame_record.h>
+
+namespace kinect_calibration
+{
+
+double hostTime()
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec/1000000.0;
+}
+
+static inline uint32_t padded(uint32_t size)
+{
+  return (size + 7) & ~7u;
+}
+
+uint32_t frameSize(int stream)
+{
+  switch (stream)
+    {
+    case STREAM_DEPTH:
+    case STREAM_IR:
+      return 640 * 480 * 2;
+    case STREAM_RGB:
+      return 640 * 480 * 3;
+    }
+  return 0;
+}
+
+FrameRecordWriter::FrameRecordWriter(size_t chunk_size, int nchunks)
+  : chunk_size_(chunk_size), fd_(-1), current_(NULL), file_pos_(0),
+    frames_(0), dropped_(0), failed_(false), closing_(false)
+{
+  pthread_mutex_init(&mutex_, NULL);
+  pthread_cond_init(&full_cond_, NULL);
+  chunks_.resize(nchunks > 1 ? nchunks : 2);
+}
+
+FrameRecordWriter::~FrameRecordWriter()
+{
+  close();
+  pthread_cond_destroy(&full_cond_);
+  pthread_mutex_destroy(&mutex_);
+}
+
+bool FrameRecordWriter::open(const std::string &fname)
+{
+  close();
+  fd_ = ::open(fname.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd_ < 0)
+    return false;
+
+  FrameFileHeader header;
+  memset(&header, 0, sizeof(header));
+  header.magic = FRAME_FILE_MAGIC;
+  header.version = FRAME_FILE_VERSION;
+  failed_ = false;
+  if (!writeAll(&header, sizeof(header)))
+    {
+      ::close(fd_);
+      fd_ = -1;
+      return false;
+    }
+  file_pos_ = sizeof(header);
+
+  // allocated up front, so recording doesn't page in new memory as it goes
+  free_.clear();
+  full_.clear();
+  for (size_t i = 0; i < chunks_.size(); i++)
+    {
+      chunks_[i].data.resize(chunk_size_);
+      free_.push_back(&chunks_[i]);
+    }
+  current_ = NULL;
+  index_.clear();
+  frames_ = dropped_ = 0;
+  closing_ = false;
+  if (pthread_create(&thread_, NULL, writer, this))
+    {
+      ::close(fd_);
+      fd_ = -1;
+      return false;
+    }
+  return true;
+}
+
+bool FrameRecordWriter::append(int stream, uint32_t timestamp, double host_time,
+                               const void *data, uint32_t size)
+{
+  if (fd_ < 0)
+    return false;
+
+  size_t need = sizeof(FrameRecordHeader) + padded(size);
+  if (current_ && current_->used + need > chunk_size_)
+    submit();
+  if (!current_)
+    {
+      pthread_mutex_lock(&mutex_);
+      if (!free_.empty())
+        {
+          current_ = free_.front();
+          free_.pop_front();
+        }
+      pthread_mutex_unlock(&mutex_);
+      if (!current_)
+        {
+          dropped_++;
+          return false;
+        }
+      current_->used = sizeof(FrameChunkHeader);
+      current_->nframes = 0;
+    }
+  if (current_->used + need > chunk_size_)
+    {
+      dropped_++;               // bigger than a chunk
+      return false;
+    }
+
+  uint8_t *p = &current_->data[current_->used];
+  FrameRecordHeader *rec = (FrameRecordHeader *)p;
+  rec->magic = FRAME_RECORD_MAGIC;
+  rec->stream = stream;
+  rec->timestamp = timestamp;
+  rec->size = size;
+  rec->host_time = host_time;
+  memcpy(p + sizeof(FrameRecordHeader), data, size);
+  memset(p + sizeof(FrameRecordHeader) + size, 0, padded(size) - size);
+
+  FrameIndexEntry entry;
+  entry.offset = file_pos_ + current_->used;
+  entry.stream = stream;
+  entry.timestamp = timestamp;
+  entry.host_time = host_time;
+  entry.size = size;
+  entry.reserved = 0;
+  index_.push_back(entry);
+
+  current_->used += need;
+  current_->nframes++;
+  frames_++;
+  return true;
+}
+
+// hands the current chunk to the writer thread
+void FrameRecordWriter::submit()
+{
+  FrameChunkHeader *header = (FrameChunkHeader *)&current_->data[0];
+  header->magic = FRAME_CHUNK_MAGIC;
+  header->nframes = current_->nframes;
+  header->size = current_->used - sizeof(FrameChunkHeader);
+  file_pos_ += current_->used;
+
+  pthread_mutex_lock(&mutex_);
+  full_.push_back(current_);
+  pthread_cond_signal(&full_cond_);
+  pthread_mutex_unlock(&mutex_);
+  current_ = NULL;
+}
+
+void *FrameRecordWriter::writer(void *arg)
+{
+  ((FrameRecordWriter *)arg)->run();
+  return NULL;
+}
+
+void FrameRecordWriter::run()
+{
+  pthread_mutex_lock(&mutex_);
+  while (true)
+    {
+      while (full_.empty() && !closing_)
+        pthread_cond_wait(&full_cond_, &mutex_);
+      if (full_.empty())
+        break;
+      Chunk *chunk = full_.front();
+      full_.pop_front();
+      pthread_mutex_unlock(&mutex_);
+
+      // once a write fails the rest would leave a hole, so they're skipped
+      if (!failed_ && !writeAll(&chunk->data[0], chunk->used))
+        failed_ = true;
+
+      pthread_mutex_lock(&mutex_);
+      free_.push_back(chunk);
+    }
+  pthread_mutex_unlock(&mutex_);
+}
+
+bool FrameRecordWriter::writeAll(const void *data, size_t size)
+{
+  const uint8_t *p = (const uint8_t *)data;
+  while (size > 0)
+    {
+      ssize_t n = ::write(fd_, p, size);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        return false;
+      p += n;
+      size -= n;
+    }
+  return true;
+}
+
+void FrameRecordWriter::close()
+{
+  if (fd_ < 0)
+    return;
+  if (current_ && current_->nframes > 0)
+    submit();
+  pthread_mutex_lock(&mutex_);
+  closing_ = true;
+  pthread_cond_signal(&full_cond_);
+  pthread_mutex_unlock(&mutex_);
+  pthread_join(thread_, NULL);
+
+  // a recording that failed part way has no index, so readers only see
+  // the chunks that made it
+  if (!failed_)
+    {
+      FrameIndexFooter footer;
+      footer.magic = FRAME_INDEX_MAGIC;
+      footer.nframes = index_.size();
+      footer.offset = file_pos_;
+      if (!(index_.empty() || writeAll(&index_[0], index_.size() * sizeof(FrameIndexEntry))) ||
+          !writeAll(&footer, sizeof(footer)))
+        failed_ = true;
+    }
+  ::close(fd_);
+  fd_ = -1;
+  current_ = NULL;
+  index_.clear();
+  for (size_t i = 0; i < chunks_.size(); i++)
+    std::vector<uint8_t>().swap(chunks_[i].data);
+}
+
+
+FrameRecording::FrameRecording() : map_(NULL), map_size_(0), skipped_(0)
+{
+}
+
+FrameRecording::~FrameRecording()
+{
+  close();
+}
+
+bool FrameRecording::open(const std::string &fname)
+{
+  close();
+  int fd = ::open(fname.c_str(), O_RDONLY);
+  if (fd < 0)
+    {
+      printf("Could not read %s\n", fname.c_str());
+      return false;
+    }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(FrameFileHeader))
+    {
+      printf("%s is not a Kinect recording\n", fname.c_str());
+      ::close(fd);
+      return false;
+    }
+  map_size_ = st.st_size;
+  void *p = mmap(NULL, map_size_, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if (p == MAP_FAILED)
+    {
+      printf("Could not map %s\n", fname.c_str());
+      map_size_ = 0;
+      return false;
+    }
+  map_ = (uint8_t *)p;
+  skipped_ = 0;
+
+  const FrameFileHeader *header = (const FrameFileHeader *)map_;
+  if (header->magic != FRAME_FILE_MAGIC || header->version > FRAME_FILE_VERSION)
+    {
+      printf("%s is not a Kinect recording\n", fname.c_str());
+      close();
+      return false;
+    }
+
+  // Replay reads the frames in file order, so read ahead of it
+  madvise(map_, map_size_, MADV_SEQUENTIAL);
+  if (header->version < 2)
+    scan(sizeof(FrameFileHeader), map_size_);
+  else if (!readIndex())
+    {
+      // never closed, or the index is damaged: walk the chunks that were
+      // written in full
+      size_t pos = sizeof(FrameFileHeader);
+      while (pos + sizeof(FrameChunkHeader) <= map_size_)
+        {
+          const FrameChunkHeader *chunk = (const FrameChunkHeader *)(map_ + pos);
+          if (chunk->magic != FRAME_CHUNK_MAGIC ||
+              chunk->size > map_size_ - pos - sizeof(FrameChunkHeader))
+            break;
+          size_t end = pos + sizeof(FrameChunkHeader) + chunk->size;
+          scan(pos + sizeof(FrameChunkHeader), end);
+          pos = end;
+        }
+    }
+  if (skipped_)
+    printf("Skipped %d frames of %s that are not the size of their stream\n", skipped_, fname.c_str());
+  return true;
+}
+
+// Only trusts the index if it agrees with the records it points at;
+// otherwise the file is read by walking the chunks, as if it had none.
+bool FrameRecording::readIndex()
+{
+  if (map_size_ < sizeof(FrameFileHeader) + sizeof(FrameIndexFooter))
+    return false;
+  const size_t index_end = map_size_ - sizeof(FrameIndexFooter);
+  const FrameIndexFooter *footer = (const FrameIndexFooter *)(map_ + index_end);
+  // the offset is checked on its own first, so nothing below can wrap
+  if (footer->magic != FRAME_INDEX_MAGIC ||
+      footer->offset < sizeof(FrameFileHeader) || footer->offset > index_end ||
+      (index_end - footer->offset) / sizeof(FrameIndexEntry) != footer->nframes ||
+      (index_end - footer->offset) % sizeof(FrameIndexEntry) != 0)
+    return false;
+
+  const FrameIndexEntry *entry = (const FrameIndexEntry *)(map_ + footer->offset);
+  frames_.reserve(footer->nframes);
+  for (uint32_t i = 0; i < footer->nframes; i++)
+    {
+      bool ok = entry[i].offset >= sizeof(FrameFileHeader) && entry[i].offset <= footer->offset &&
+        footer->offset - entry[i].offset >= sizeof(FrameRecordHeader) &&
+        footer->offset - entry[i].offset - sizeof(FrameRecordHeader) >= entry[i].size;
+      if (ok)
+        {
+          const FrameRecordHeader *rec = (const FrameRecordHeader *)(map_ + entry[i].offset);
+          ok = rec->magic == FRAME_RECORD_MAGIC && rec->stream == entry[i].stream &&
+            rec->size == entry[i].size;
+        }
+      if (!ok)
+        {
+          frames_.clear();
+          skipped_ = 0;
+          return false;
+        }
+      // the frame is passed on as a whole frame of its stream
+      if (entry[i].size != frameSize(entry[i].stream))
+        {
+          skipped_++;
+          continue;
+        }
+      FrameRecord frame;
+      frame.stream = entry[i].stream;
+      frame.timestamp = entry[i].timestamp;
+      frame.host_time = entry[i].host_time;
+      frame.size = entry[i].size;
+      frame.data = map_ + entry[i].offset + sizeof(FrameRecordHeader);
+      frames_.push_back(frame);
+    }
+  return true;
+}
+
+// adds the records between pos and end
+void FrameRecording::scan(size_t pos, size_t end)
+{
+  while (pos + sizeof(FrameRecordHeader) <= end)
+    {
+      const FrameRecordHeader *rec = (const FrameRecordHeader *)(map_ + pos);
+      if (rec->magic != FRAME_RECORD_MAGIC ||
+          pos + sizeof(FrameRecordHeader) + rec->size > end)
+        break;
+      if (rec->size != frameSize(rec->stream))
+        {
+          skipped_++;
+          pos += sizeof(FrameRecordHeader) + padded(rec->size);
+          continue;
+        }
+      FrameRecord frame;
+      frame.stream = rec->stream;
+      frame.timestamp = rec->timestamp;
+      frame.host_time = rec->host_time;
+      frame.size = rec->size;
+      frame.data = map_ + pos + sizeof(FrameRecordHeader);
+      frames_.push_back(frame);
+      pos += sizeof(FrameRecordHeader) + padded(rec->size);
+    }
+}
+
+static bool beforeTime(const FrameRecord &frame, double host_time)
+{
+  return frame.host_time < host_time;
+}
+
+size_t FrameRecording::find(double host_time) const
+{
+  return std::lower_bound(frames_.begin(), frames_.end(), host_time, beforeTime) - frames_.begin();
+}
+
+void FrameRecording::close()
+{
+  if (map_)
+    munmap(map_, map_size_);
+  map_ = NULL;
+  map_size_ = 0;
+  frames_.clear();
+}
+
+} // namespace kinect_calibration
@@ -0,0 +1,110 @@
+/*********************************************************************
+* Software License Agreement (BSD License)
+*
+*  Copyright (c) 2009, Willow Garage, Inc.
+*  All rights reserved.
+*
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions
+*  are met:
+*
+*   * Redistributions of source code must retain the above copyright
+*     notice, this list of conditions and the following disclaimer.
+*   * Redistributions in binary form must reproduce the above
+*     copyright notice, this list of conditions and the following
+*     disclaimer in the documentation and/or other materials provided
+*     with the distribution.
+*   * Neither the name of the Willow Garage nor the names of its
+*     contributors may be used to endorse or promote products derived
+*     from this software without specific prior written permission.
+*
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+*  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+*  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+*  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+*  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+*  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+*  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+*  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+*  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+*  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+*  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+*  POSSIBILITY OF SUCH DAMAGE.
+*********************************************************************/
+
+
+#include <unistd.h>
+#include <kinect_calibration/frame_source.h>
+
+namespace kinect_calibration
+{
+
+ReplaySource::ReplaySource(const FrameRecording &rec, double rate, bool loop)
+  : rec_(rec), rate_(rate), loop_(loop), video_(STREAM_RGB), running_(false),
+    next_(0), start_host_(0.0), start_rec_(0.0), delivered_(0)
+{
+}
+
+bool ReplaySource::start(int video)
+{
+  video_ = video;
+  running_ = rec_.size() > 0;
+  next_ = 0;
+  start_host_ = hostTime();
+  start_rec_ = running_ ? rec_.frame(0).host_time : 0.0;
+  return running_;
+}
+
+void ReplaySource::setVideo(int video)
+{
+  video_ = video;
+}
+
+bool ReplaySource::process()
+{
+  if (!running_)
+    return false;
+
+  if (next_ >= rec_.size())
+    {
+      if (!loop_)
+        {
+          running_ = false;
+          return false;
+        }
+      next_ = 0;
+      start_host_ = hostTime();
+      start_rec_ = rec_.frame(0).host_time;
+    }
+
+  const FrameRecord &frame = rec_.frame(next_);
+  if (frame.stream != STREAM_DEPTH && frame.stream != video_)
+    {
+      next_++;
+      return true;
+    }
+
+  if (rate_ > 0.0)
+    {
+      double due = start_host_ + (frame.host_time - start_rec_) / rate_;
+      double wait = due - hostTime();
+      if (wait > 0.0)
+        {
+          // short naps, so stop() and setVideo() take effect quickly
+          usleep((useconds_t)((wait < 0.01 ? wait : 0.01) * 1e6));
+          return true;
+        }
+    }
+
+  deliver(frame.stream, frame.data, frame.timestamp);
+  delivered_++;
+  next_++;
+  return true;
+}
+
+void ReplaySource::stop()
+{
+  running_ = false;
+}
+
+} // namespace kinect_calibration
@@ -0,0 +1,225 @@
+/*********************************************************************
+* Software License Agreement (BSD License)
+*
+*  Copyright (c) 2009, Willow Garage, Inc.
+*  All rights reserved.
+*
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions
+*  are met:
+*
+*   * Redistributions of source code must retain the above copyright
+*     notice, this list of conditions and the following disclaimer.
+*   * Redistributions in binary form must reproduce the above
+*     copyright notice, this list of conditions and the following
+*     disclaimer in the documentation and/or other materials provided
+*     with the distribution.
+*   * Neither the name of the Willow Garage nor the names of its
+*     contributors may be used to endorse or promote products derived
+*     from this software without specific prior written permission.
+*
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+*  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+*  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+*  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+*  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+*  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+*  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+*  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+*  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+*  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+*  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+*  POSSIBILITY OF SUCH DAMAGE.
+*********************************************************************/
+
+
+#include <stdio.h>
+#include <opencv2/highgui/highgui.hpp>
+#include <kinect_calibration/image_writer.h>
+#include <kinect_calibration/parallel.h>
+
+namespace kinect_calibration
+{
+
+ImageWriter::ImageWriter(int nthreads, int max_queue, int png_compression)
+  : max_queue_(max_queue > 0 ? max_queue : 1), busy_(0), failed_(0), stop_(false)
+{
+  pthread_mutex_init(&mutex_, NULL);
+  pthread_cond_init(&work_, NULL);
+  pthread_cond_init(&done_, NULL);
+  params_.push_back(CV_IMWRITE_PNG_COMPRESSION);
+  params_.push_back(png_compression);
+
+  if (nthreads <= 0) nthreads = defaultThreads();
+  for (int i = 0; i < nthreads; i++)
+    {
+      pthread_t t;
+      if (pthread_create(&t, NULL, worker, this))
+        break;
+      threads_.push_back(t);
+    }
+}
+
+ImageWriter::~ImageWriter()
+{
+  pthread_mutex_lock(&mutex_);
+  stop_ = true;
+  pthread_cond_broadcast(&work_);
+  pthread_mutex_unlock(&mutex_);
+  for (size_t i = 0; i < threads_.size(); i++)
+    pthread_join(threads_[i], NULL);
+
+  pthread_cond_destroy(&done_);
+  pthread_cond_destroy(&work_);
+  pthread_mutex_destroy(&mutex_);
+}
+
+void ImageWriter::write(const std::string &fname, const cv::Mat &img)
+{
+  Job job;
+  job.fnames.push_back(fname);
+  job.imgs.push_back(img);
+  job.group = false;
+  job.done = NULL;
+  job.arg = NULL;
+  queue(job);
+}
+
+void ImageWriter::writeGroup(const std::vector<std::string> &fnames, const std::vector<cv::Mat> &imgs,
+                             DoneFn done, void *arg)
+{
+  Job job;
+  job.fnames = fnames;
+  job.imgs = imgs;
+  job.group = true;
+  job.done = done;
+  job.arg = arg;
+  queue(job);
+}
+
+void ImageWriter::queue(const Job &job)
+{
+  // no threads could be started: write it here and now, so flush() and
+  // failed() mean the same as with threads
+  if (threads_.empty())
+    {
+      size_t nplaced = writeJob(job);
+      pthread_mutex_lock(&mutex_);
+      failed_ += job.fnames.size() - nplaced;
+      pthread_mutex_unlock(&mutex_);
+      return;
+    }
+
+  pthread_mutex_lock(&mutex_);
+  while ((int)queue_.size() >= max_queue_)
+    pthread_cond_wait(&done_, &mutex_);
+  queue_.push_back(job);
+  pthread_cond_signal(&work_);
+  pthread_mutex_unlock(&mutex_);
+}
+
+void ImageWriter::flush()
+{
+  pthread_mutex_lock(&mutex_);
+  while (!queue_.empty() || busy_ > 0)
+    pthread_cond_wait(&done_, &mutex_);
+  pthread_mutex_unlock(&mutex_);
+}
+
+int ImageWriter::failed()
+{
+  pthread_mutex_lock(&mutex_);
+  int n = failed_;
+  pthread_mutex_unlock(&mutex_);
+  return n;
+}
+
+// foo.png is written as foo.tmp.png, so imwrite still sees the extension
+static std::string tmpName(const std::string &fname)
+{
+  size_t dot = fname.rfind('.');
+  size_t slash = fname.rfind('/');
+  if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+    return fname + ".tmp";
+  return fname.substr(0, dot) + ".tmp" + fname.substr(dot);
+}
+
+// returns how many of the images are in place
+size_t ImageWriter::writeJob(const Job &job)
+{
+  bool ok = true;
+  size_t nwritten = 0;          // including one that failed half way
+  while (ok && nwritten < job.fnames.size())
+    {
+      const std::string fname = job.group ? tmpName(job.fnames[nwritten]) : job.fnames[nwritten];
+      try
+        {
+          ok = cv::imwrite(fname, job.imgs[nwritten], params_);
+        }
+      catch (cv::Exception &e)
+        {
+          ok = false;
+        }
+      if (!ok)
+        fprintf(stderr, "Could not write %s\n", fname.c_str());
+      nwritten++;
+    }
+
+  size_t nplaced = ok ? nwritten : 0;
+  if (job.group)
+    {
+      // put them all in place.  A file already renamed has replaced the
+      // old one of that name, so it stays; only the rest are cleaned up.
+      nplaced = 0;
+      while (ok && nplaced < nwritten)
+        {
+          const std::string tmp = tmpName(job.fnames[nplaced]);
+          if (rename(tmp.c_str(), job.fnames[nplaced].c_str()) != 0)
+            {
+              fprintf(stderr, "Could not rename %s\n", tmp.c_str());
+              ok = false;
+            }
+          else
+            nplaced++;
+        }
+      for (size_t i = nplaced; i < nwritten; i++)
+        remove(tmpName(job.fnames[i]).c_str());
+    }
+
+  if (job.done)
+    job.done(job.fnames, nplaced, job.arg);
+  return nplaced;
+}
+
+void *ImageWriter::worker(void *arg)
+{
+  ((ImageWriter *)arg)->run();
+  return NULL;
+}
+
+void ImageWriter::run()
+{
+  pthread_mutex_lock(&mutex_);
+  while (1)
+    {
+      while (queue_.empty() && !stop_)
+        pthread_cond_wait(&work_, &mutex_);
+      if (queue_.empty())
+        break;                  // stopping, and nothing left to write
+      Job job = queue_.front();
+      queue_.pop_front();
+      busy_++;
+      pthread_cond_broadcast(&done_);
+      pthread_mutex_unlock(&mutex_);
+
+      size_t nplaced = writeJob(job);
+
+      pthread_mutex_lock(&mutex_);
+      failed_ += job.fnames.size() - nplaced;
+      busy_--;
+      pthread_cond_broadcast(&done_);
+    }
+  pthread_mutex_unlock(&mutex_);
+}
+
+} // namespace kinect_calibration
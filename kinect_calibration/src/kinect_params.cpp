@@ -0,0 +1,151 @@
+/*********************************************************************
+* Software License Agreement (BSD License)
+*
+*  Copyright (c) 2009, Willow Garage, Inc.
+*  All rights reserved.
+*
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions
+*  are met:
+*
+*   * Redistributions of source code must retain the above copyright
+*     notice, this list of conditions and the following disclaimer.
+*   * Redistributions in binary form must reproduce the above
+*     copyright notice, this list of conditions and the following
+*     disclaimer in the documentation and/or other materials provided
+*     with the distribution.
+*   * Neither the name of the Willow Garage nor the names of its
+*     contributors may be used to endorse or promote products derived
+*     from this software without specific prior written permission.
+*
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+*  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+*  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+*  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+*  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+*  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+*  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+*  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+*  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+*  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+*  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+*  POSSIBILITY OF SUCH DAMAGE.
+*********************************************************************/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <kinect_calibration/kinect_params.h>
+
+namespace kinect_calibration
+{
+
+// reads a whole (small) text file
+bool readFile(const std::string &fname, std::string &text)
+{
+  FILE *f = fopen(fname.c_str(), "r");
+  if (!f)
+    {
+      printf("Could not read %s\n", fname.c_str());
+      return false;
+    }
+  char buf[4096];
+  size_t n;
+  text.clear();
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+    text.append(buf, n);
+  fclose(f);
+  return true;
+}
+
+// finds "key:" and reads n numbers after it, either a plain value or a
+// "[ a, b, ... ]" list, which may come after a "data:" line
+bool readValues(const std::string &text, const char *key, double *out, int n)
+{
+  size_t pos = text.find(std::string(key) + ":");
+  if (pos == std::string::npos)
+    return false;
+  const char *p = text.c_str() + pos + strlen(key) + 1;
+  if (n > 1)
+    {
+      p = strchr(p, '[');
+      if (!p) return false;
+      p++;
+    }
+  for (int i = 0; i < n; i++)
+    {
+      char *end;
+      out[i] = strtod(p, &end);
+      if (end == p) return false;
+      p = end;
+      while (*p == ',' || *p == ' ' || *p == '\n') p++;
+    }
+  return true;
+}
+
+bool readCalibration(const std::string &fname, double K[9], double D[5])
+{
+  std::string text;
+  if (!readFile(fname, text))
+    return false;
+  if (!readValues(text, "camera_matrix", K, 9) ||
+      !readValues(text, "distortion_coefficients", D, 5))
+    {
+      printf("Bad camera calibration file %s\n", fname.c_str());
+      return false;
+    }
+  return true;
+}
+
+KinectParams::KinectParams()
+{
+  memset(this, 0, sizeof(*this));
+}
+
+bool KinectParams::load(const std::string &dir)
+{
+  if (!readCalibration(dir + "/calibration_depth.yaml", depth_K, depth_D) ||
+      !readCalibration(dir + "/calibration_rgb.yaml", rgb_K, rgb_D))
+    return false;
+
+  std::string text, fname = dir + "/kinect_params.yaml";
+  if (!readFile(fname, text))
+    return false;
+  if (!readValues(text, "shift_offset", &shift_offset, 1) ||
+      !readValues(text, "projector_depth_baseline", &baseline, 1) ||
+      !readValues(text, "depth_rgb_rotation", R, 9) ||
+      !readValues(text, "depth_rgb_translation", T, 3))
+    {
+      printf("Bad parameter file %s\n", fname.c_str());
+      return false;
+    }
+  return true;
+}
+
+Eigen::Matrix<double,3,4> KinectParams::depthToRgb() const
+{
+  Eigen::Matrix4d Q,S;          // transformations
+  Eigen::Matrix<double,3,4> P;  // projection
+
+  // from u,v,d of depth camera to XYZ
+  Q << 1, 0, 0,    -depth_K[2],  // -cx
+       0, 1, 0,    -depth_K[5],  // -cy
+       0, 0, 0,     depth_K[0],  // focal length
+       0, 0, 1.0/baseline, 0;    // baseline
+
+  // from XYZ of depth camera to XYZ of RGB camera
+  S << R[0], R[1], R[2], T[0],
+       R[3], R[4], R[5], T[1],
+       R[6], R[7], R[8], T[2],
+       0,    0,    0,    1;
+
+  // from XYZ to u,v in RGB camera
+  P << rgb_K[0], 0,        rgb_K[2], 0,
+       0,        rgb_K[4], rgb_K[5], 0,
+       0,        0,        1,        0;
+
+  return P*S*Q;
+}
+
+} // namespace kinect_calibration
@@ -0,0 +1,214 @@
+/*********************************************************************
+* Software License Agreement (BSD License)
+*
+*  Copyright (c) 2009, Willow Garage, Inc.
+*  All rights reserved.
+*
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions
+*  are met:
+*
+*   * Redistributions of source code must retain the above copyright
+*     notice, this list of conditions and the following disclaimer.
+*   * Redistributions in binary form must reproduce the above
+*     copyright notice, this list of conditions and the following
+*     disclaimer in the documentation and/or other materials provided
+*     with the distribution.
+*   * Neither the name of the Willow Garage nor the names of its
+*     contributors may be used to endorse or promote products derived
+*     from this software without specific prior written permission.
+*
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+*  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+*  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+*  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+*  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+*  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+*  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+*  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+*  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+*  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+*  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+*  POSSIBILITY OF SUCH DAMAGE.
+*********************************************************************/
+
+
+// Streams registered images from a calibrated Kinect.
+//
+// Loads the files calibrate writes (~calibration_dir) and, for every
+// synchronized pair of raw depth (16-bit shifts) and RGB images,
+// publishes
+//   depth_registered/image  depth in mm, in the rectified RGB image
+//   rgb_mapped/image        rectified RGB mapped into the depth image
+//   depth_corrected/image   depth in mm, in the depth image, with the
+//                           dense correction applied (only if calibrate
+//                           wrote a depth_correction.yaml)
+//
+// Everything that depends only on the calibration is computed once at
+// startup: the RGB undistortion maps (in the fixed-point form cv::remap
+// is fastest with), the depth->RGB transform, and the shift tables.
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <ros/ros.h>
+#include <sensor_msgs/Image.h>
+#include <message_filters/subscriber.h>
+#include <message_filters/time_synchronizer.h>
+#include <boost/bind.hpp>
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include <kinect_calibration/depth_correction.h>
+#include <kinect_calibration/kinect_params.h>
+#include <kinect_calibration/registration.h>
+#include <kinect_calibration/shift_lut.h>
+
+// image size
+#define ROWS 480
+#define COLS 640
+
+using namespace kinect_calibration;
+
+class DepthRegistrationNode
+{
+  ros::NodeHandle n_;
+  message_filters::Subscriber<sensor_msgs::Image> depth_sub_, rgb_sub_;
+  message_filters::TimeSynchronizer<sensor_msgs::Image, sensor_msgs::Image> sync_;
+  ros::Publisher depth_pub_, mapped_pub_, corrected_pub_;
+
+  KinectParams params_;
+  ShiftLUT lut_;
+  DepthRegistration *registration_;
+  cv::Mat map1_, map2_;              // RGB undistortion lookup tables
+  cv::Mat rgb_rect_;
+  std::vector<uint16_t> reg_shift_;
+  DepthCorrection correction_;
+  bool have_correction_;
+  std::vector<float> depth_m_;
+  int nthreads_;
+
+public:
+  DepthRegistrationNode()
+    : depth_sub_(n_, "depth/image_raw", 2), rgb_sub_(n_, "rgb/image_raw", 2),
+      sync_(depth_sub_, rgb_sub_, 5), registration_(NULL)
+  {
+    ros::NodeHandle nh("~");
+    std::string dir;
+    nh.param("calibration_dir", dir, std::string("."));
+    nh.param("threads", nthreads_, 0);
+    if (!params_.load(dir))
+      {
+        ROS_FATAL("Could not load the Kinect calibration from %s", dir.c_str());
+        ros::shutdown();
+        return;
+      }
+
+    lut_ = ShiftLUT(params_.shift_offset, params_.baseline, params_.depth_K[0]);
+    registration_ = new DepthRegistration(params_.depthToRgb(), lut_, ROWS, COLS);
+
+    cv::Mat K(3, 3, CV_64F, params_.rgb_K);
+    cv::Mat D(1, 5, CV_64F, params_.rgb_D);
+    cv::Mat map1, map2;
+    cv::initUndistortRectifyMap(K, D, cv::Mat(), K, cv::Size(COLS,ROWS), CV_32FC1, map1, map2);
+    cv::convertMaps(map1, map2, map1_, map2_, CV_16SC2);
+
+    rgb_rect_.create(ROWS, COLS, CV_8UC3);
+    reg_shift_.resize(ROWS*COLS);
+    correction_ = DepthCorrection(ROWS, COLS);
+    have_correction_ = access((dir + "/depth_correction.yaml").c_str(), R_OK) == 0 &&
+      correction_.load(dir + "/depth_correction.yaml");
+    depth_m_.resize(ROWS*COLS);
+
+    depth_pub_ = n_.advertise<sensor_msgs::Image>("depth_registered/image", 1);
+    mapped_pub_ = n_.advertise<sensor_msgs::Image>("rgb_mapped/image", 1);
+    if (have_correction_)
+      corrected_pub_ = n_.advertise<sensor_msgs::Image>("depth_corrected/image", 1);
+    sync_.registerCallback(boost::bind(&DepthRegistrationNode::imagecb, this, _1, _2));
+  }
+
+  ~DepthRegistrationNode()
+  {
+    delete registration_;
+  }
+
+  void imagecb(const sensor_msgs::ImageConstPtr &depth, const sensor_msgs::ImageConstPtr &rgb)
+  {
+    if (depth->width != COLS || depth->height != ROWS || depth->step != COLS*2 ||
+        rgb->width != COLS || rgb->height != ROWS || rgb->step != COLS*3)
+      {
+        ROS_WARN_THROTTLE(5, "Expected %dx%d 16-bit depth and 8-bit 3-channel RGB images", COLS, ROWS);
+        return;
+      }
+
+    bool want_depth = depth_pub_.getNumSubscribers() > 0;
+    bool want_mapped = mapped_pub_.getNumSubscribers() > 0;
+    bool want_corrected = have_correction_ && corrected_pub_.getNumSubscribers() > 0;
+    if (want_corrected)
+      {
+        sensor_msgs::Image out;
+        out.header = depth->header;
+        out.height = ROWS;
+        out.width = COLS;
+        out.encoding = "16UC1";
+        out.step = COLS*2;
+        out.data.resize(ROWS*COLS*2);
+        lut_.toDepth((const uint16_t *)&depth->data[0], &depth_m_[0], ROWS*COLS);
+        correction_.apply(&depth_m_[0]);
+        uint16_t *optr = (uint16_t *)&out.data[0];
+        for (int i = 0; i < ROWS*COLS; i++)
+          optr[i] = depth_m_[i] < 65.535f ? (uint16_t)(depth_m_[i]*1000.0f + 0.5f) : 0;
+        corrected_pub_.publish(out);
+      }
+    if (!want_depth && !want_mapped)
+      return;
+
+    sensor_msgs::Image mapped;
+    if (want_mapped)
+      {
+        // only the mapped image needs the rectified RGB image
+        cv::Mat img(ROWS, COLS, CV_8UC3, (void *)&rgb->data[0]);
+        cv::remap(img, rgb_rect_, map1_, map2_, cv::INTER_LINEAR);
+        mapped.header = depth->header;
+        mapped.height = ROWS;
+        mapped.width = COLS;
+        mapped.encoding = rgb->encoding; // channels are copied as-is
+        mapped.step = COLS*3;
+        mapped.data.resize(ROWS*COLS*3);
+      }
+
+    registration_->registerDepth((const uint16_t *)&depth->data[0],
+                                 want_mapped ? rgb_rect_.ptr<uint8_t>(0) : NULL,
+                                 NULL, want_depth ? &reg_shift_[0] : NULL,
+                                 want_mapped ? &mapped.data[0] : NULL,
+                                 nthreads_);
+
+    if (want_depth)
+      {
+        sensor_msgs::Image out;
+        out.header = rgb->header;
+        out.height = ROWS;
+        out.width = COLS;
+        out.encoding = "16UC1";
+        out.step = COLS*2;
+        out.data.resize(ROWS*COLS*2);
+        // the shift of the nearest point that landed on each RGB pixel;
+        // 2047 (no reading) where nothing did
+        lut_.toDepthMM(&reg_shift_[0], (uint16_t *)&out.data[0], ROWS*COLS);
+        depth_pub_.publish(out);
+      }
+    if (want_mapped)
+      mapped_pub_.publish(mapped);
+  }
+};
+
+int
+main(int argc, char **argv)
+{
+  ros::init(argc, argv, "register_depth");
+  DepthRegistrationNode node;
+  ros::spin();
+  return 0;
+}
@@ -0,0 +1,216 @@
+/*********************************************************************
+* Software License Agreement (BSD License)
+*
+*  Copyright (c) 2009, Willow Garage, Inc.
+*  All rights reserved.
+*
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions
+*  are met:
+*
+*   * Redistributions of source code must retain the above copyright
+*     notice, this list of conditions and the following disclaimer.
+*   * Redistributions in binary form must reproduce the above
+*     copyright notice, this list of conditions and the following
+*     disclaimer in the documentation and/or other materials provided
+*     with the distribution.
+*   * Neither the name of the Willow Garage nor the names of its
+*     contributors may be used to endorse or promote products derived
+*     from this software without specific prior written permission.
+*
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+*  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+*  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+*  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+*  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+*  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+*  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+*  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+*  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+*  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+*  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+*  POSSIBILITY OF SUCH DAMAGE.
+*********************************************************************/
+
+
+#include <string.h>
+#include <kinect_calibration/registration.h>
+#include <kinect_calibration/parallel.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace kinect_calibration
+{
+
+DepthRegistration::DepthRegistration(const Eigen::Matrix<double,3,4>& D, const ShiftLUT &lut,
+                                     int rows, int cols)
+  : rows_(rows), cols_(cols)
+{
+  for (int r = 0; r < 3; r++)
+    {
+      dcol_[r]  = D(r,0);
+      drow_[r]  = D(r,1);
+      ddisp_[r] = D(r,2);
+      doff_[r]  = D(r,3);
+    }
+
+  for (int s = 0; s < 2048; s++)
+    {
+      disp_[s] = lut.disparity[s];
+      // rounded from the double disparity, as calibrate always has
+      double d = SHIFT_SCALE*(lut.shift_offset - s);
+      disp16_[s] = lut.valid[s] ? (int)(d*16+0.499) : 0;
+    }
+
+  target_.resize(rows*cols);
+  vmin_.resize(rows);
+  vmax_.resize(rows);
+  band_rows_ = 16;
+}
+
+static void projectRowTask(int i, void *arg)
+{
+  ((DepthRegistration *)arg)->projectRow(i);
+}
+
+static void zbufferBandTask(int band, void *arg)
+{
+  ((DepthRegistration *)arg)->zbufferBand(band);
+}
+
+void DepthRegistration::registerDepth(const uint16_t *depth, const uint8_t *rgb,
+                                      uint16_t *reg_disp, uint16_t *reg_shift, uint8_t *rgb_mapped,
+                                      int nthreads)
+{
+  depth_ = depth;
+  rgb_ = rgb;
+  reg_disp_ = reg_disp;
+  reg_shift_ = reg_shift;
+  rgb_mapped_ = rgb ? rgb_mapped : NULL;
+
+  int n = rows_*cols_;
+  if (reg_shift_ && !reg_disp_)
+    {
+      zbuf_.resize(n);          // still need a z-buffer to pick the nearest shift
+      reg_disp_ = &zbuf_[0];
+    }
+  if (reg_disp_)
+    memset(reg_disp_, 0, n*sizeof(uint16_t));
+  if (reg_shift_)
+    for (int k = 0; k < n; k++)
+      reg_shift_[k] = 2047;
+  if (rgb_mapped_)
+    memset(rgb_mapped_, 0, n*3);
+
+  parallelFor(rows_, projectRowTask, this, nthreads);
+  if (reg_disp_ || reg_shift_)
+    parallelFor((rows_ + band_rows_ - 1) / band_rows_, zbufferBandTask, this, nthreads);
+}
+
+void DepthRegistration::projectRow(int i)
+{
+  const uint16_t *dptr = depth_ + i*cols_;
+  int *tptr = &target_[i*cols_];
+  int vmin = rows_, vmax = -1;
+
+  // constant part of D*(j,i,d,1) for this row
+  float rx = drow_[0]*i + doff_[0];
+  float ry = drow_[1]*i + doff_[1];
+  float rz = drow_[2]*i + doff_[2];
+
+  int u[4], v[4];
+  float d[4];
+  int j = 0;
+  while (j < cols_)
+    {
+      int m = cols_ - j < 4 ? cols_ - j : 4;
+      for (int l = 0; l < m; l++)
+        d[l] = disp_[dptr[j+l] & 2047];
+      for (int l = m; l < 4; l++)
+        d[l] = 0.0f;
+
+#ifdef __SSE2__
+      __m128 jv = _mm_set_ps(j+3, j+2, j+1, j);
+      __m128 dv = _mm_loadu_ps(d);
+      __m128 qx = _mm_add_ps(_mm_add_ps(_mm_set1_ps(rx), _mm_mul_ps(_mm_set1_ps(dcol_[0]), jv)),
+                             _mm_mul_ps(_mm_set1_ps(ddisp_[0]), dv));
+      __m128 qy = _mm_add_ps(_mm_add_ps(_mm_set1_ps(ry), _mm_mul_ps(_mm_set1_ps(dcol_[1]), jv)),
+                             _mm_mul_ps(_mm_set1_ps(ddisp_[1]), dv));
+      __m128 qz = _mm_add_ps(_mm_add_ps(_mm_set1_ps(rz), _mm_mul_ps(_mm_set1_ps(dcol_[2]), jv)),
+                             _mm_mul_ps(_mm_set1_ps(ddisp_[2]), dv));
+      __m128 half = _mm_set1_ps(0.5f);
+      // points at or behind the RGB camera come out as -1, off the image
+      __m128i behind = _mm_castps_si128(_mm_cmple_ps(qz, _mm_setzero_ps()));
+      // truncating conversion, same as the (int) cast in the scalar path
+      _mm_storeu_si128((__m128i *)u, _mm_or_si128(_mm_cvttps_epi32(_mm_add_ps(_mm_div_ps(qx, qz), half)), behind));
+      _mm_storeu_si128((__m128i *)v, _mm_or_si128(_mm_cvttps_epi32(_mm_add_ps(_mm_div_ps(qy, qz), half)), behind));
+#else
+      for (int l = 0; l < m; l++)
+        {
+          float qx = rx + dcol_[0]*(j+l) + ddisp_[0]*d[l];
+          float qy = ry + dcol_[1]*(j+l) + ddisp_[1]*d[l];
+          float qz = rz + dcol_[2]*(j+l) + ddisp_[2]*d[l];
+          if (!(qz > 0.0f))
+            {
+              u[l] = v[l] = -1;   // at or behind the RGB camera
+              continue;
+            }
+          u[l] = (int)(qx/qz+0.5f);
+          v[l] = (int)(qy/qz+0.5f);
+        }
+#endif
+
+      for (int l = 0; l < m; l++, j++)
+        {
+          tptr[j] = -1;
+          if (d[l] <= 0.0f)
+            continue;             // not valid
+          if (u[l] < 0 || v[l] < 0 || u[l] >= cols_ || v[l] >= rows_)
+            continue;
+          int kk = v[l]*cols_ + u[l];
+          tptr[j] = kk;
+          if (v[l] < vmin) vmin = v[l];
+          if (v[l] > vmax) vmax = v[l];
+          if (rgb_mapped_)
+            memcpy(&rgb_mapped_[3*(i*cols_+j)], &rgb_[3*kk], 3);
+        }
+    }
+
+  vmin_[i] = vmin;
+  vmax_[i] = vmax;
+}
+
+void DepthRegistration::zbufferBand(int band)
+{
+  int v0 = band*band_rows_;
+  int v1 = v0 + band_rows_;
+  int k0 = v0*cols_;
+  int k1 = (v1 < rows_ ? v1 : rows_)*cols_;
+
+  for (int i = 0; i < rows_; i++)
+    {
+      if (vmax_[i] < v0 || vmin_[i] >= v1)
+        continue;               // nothing in this row lands in our band
+      const int *tptr = &target_[i*cols_];
+      const uint16_t *dptr = depth_ + i*cols_;
+      for (int j = 0; j < cols_; j++)
+        {
+          int kk = tptr[j];
+          if (kk < k0 || kk >= k1)
+            continue;
+          uint16_t disp = disp16_[dptr[j] & 2047];
+          if (reg_disp_)
+            {
+              if (reg_disp_[kk] >= disp) // z-buffer check
+                continue;
+              reg_disp_[kk] = disp;
+            }
+          if (reg_shift_)
+            reg_shift_[kk] = dptr[j];
+        }
+    }
+}
+
+} // namespace kinect_calibration
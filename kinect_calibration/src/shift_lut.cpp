@@ -0,0 +1,97 @@
+/*********************************************************************
+* Software License Agreement (BSD License)
+*
+*  Copyright (c) 2009, Willow Garage, Inc.
+*  All rights reserved.
+*
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions
+*  are met:
+*
+*   * Redistributions of source code must retain the above copyright
+*     notice, this list of conditions and the following disclaimer.
+*   * Redistributions in binary form must reproduce the above
+*     copyright notice, this list of conditions and the following
+*     disclaimer in the documentation and/or other materials provided
+*     with the distribution.
+*   * Neither the name of the Willow Garage nor the names of its
+*     contributors may be used to endorse or promote products derived
+*     from this software without specific prior written permission.
+*
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+*  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+*  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+*  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+*  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+*  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+*  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+*  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+*  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+*  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+*  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+*  POSSIBILITY OF SUCH DAMAGE.
+*********************************************************************/
+
+
+#include <kinect_calibration/shift_lut.h>
+#include <kinect_calibration/kinect_params.h>
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+namespace kinect_calibration
+{
+
+ShiftLUT::ShiftLUT(double shift_offset, double baseline, double focal)
+{
+  build(shift_offset, baseline, focal);
+}
+
+void ShiftLUT::build(double offset, double baseline, double focal)
+{
+  shift_offset = offset;
+  for (int s = 0; s < 2048; s++)
+    {
+      double d = SHIFT_SCALE*(shift_offset - s);
+      valid[s] = s < 2047 && d > 0;  // 2047 is what the Kinect sends for no reading
+      disparity[s] = valid[s] ? d : 0.0;
+      // Z = f*b/d, from the Q matrix in calibrate
+      double z = valid[s] ? focal*baseline/d : 0.0;
+      depth[s] = z;
+      depth_mm[s] = z*1000.0 < 65535.0 ? (uint16_t)(z*1000.0+0.5) : 0;
+    }
+}
+
+bool ShiftLUT::load(const std::string &dir)
+{
+  KinectParams params;
+  if (!params.load(dir))
+    return false;
+  build(params.shift_offset, params.baseline, params.depth_K[0]);
+  return true;
+}
+
+void ShiftLUT::toDepth(const uint16_t *shift, float *out, int n) const
+{
+  int i = 0;
+#ifdef __AVX2__
+  const __m256i mask = _mm256_set1_epi32(2047);
+  for (; i + 8 <= n; i += 8)
+    {
+      __m256i s = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(shift + i)));
+      s = _mm256_and_si256(s, mask);
+      _mm256_storeu_ps(out + i, _mm256_i32gather_ps(depth, s, 4));
+    }
+#endif
+  for (; i < n; i++)
+    out[i] = depth[shift[i] & 2047];
+}
+
+void ShiftLUT::toDepthMM(const uint16_t *shift, uint16_t *out, int n) const
+{
+  for (int i = 0; i < n; i++)
+    out[i] = depth_mm[shift[i] & 2047];
+}
+
+} // namespace kinect_calibration
@@ -0,0 +1,266 @@
+/*********************************************************************
+* Software License Agreement (BSD License)
+*
+*  Copyright (c) 2009, Willow Garage, Inc.
+*  All rights reserved.
+*
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions
+*  are met:
+*
+*   * Redistributions of source code must retain the above copyright
+*     notice, this list of conditions and the following disclaimer.
+*   * Redistributions in binary form must reproduce the above
+*     copyright notice, this list of conditions and the following
+*     disclaimer in the documentation and/or other materials provided
+*     with the distribution.
+*   * Neither the name of the Willow Garage nor the names of its
+*     contributors may be used to endorse or promote products derived
+*     from this software without specific prior written permission.
+*
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+*  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+*  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+*  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+*  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+*  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+*  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+*  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+*  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+*  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+*  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+*  POSSIBILITY OF SUCH DAMAGE.
+*********************************************************************/
+
+#include <math.h>
+#include <algorithm>
+#include <kinect_calibration/view_scorer.h>
+
+namespace kinect_calibration
+{
+
+// what counts as a different view: a new part of the image, or a pose
+// one of these steps away from every saved one
+#define MIN_NEW_CELLS  2
+#define ANGLE_STEP     (10.0 * M_PI / 180.0)
+#define DISTANCE_STEP  1.25        // ratio
+#define CENTER_STEP    0.15        // of the image width
+// a view is sharp enough at this fraction of the saved views' median
+#define SHARP_FRACTION 0.7
+
+ViewScorer::ViewScorer(cv::Size pattern, cv::Size image, double focal,
+                       int grid_cols, int grid_rows)
+  : pattern_(pattern), image_(image), focal_(focal),
+    grid_cols_(grid_cols), grid_rows_(grid_rows),
+    covered_(grid_cols * grid_rows, 0)
+{
+}
+
+// solves a x = b in place, for n <= 8; false if singular
+static bool solve(double a[8][8], double b[8], int n)
+{
+  for (int c = 0; c < n; c++)
+    {
+      int p = c;
+      for (int r = c+1; r < n; r++)
+        if (fabs(a[r][c]) > fabs(a[p][c]))
+          p = r;
+      if (fabs(a[p][c]) < 1e-12)
+        return false;
+      std::swap(a[c], a[p]);
+      std::swap(b[c], b[p]);
+      for (int r = c+1; r < n; r++)
+        {
+          double f = a[r][c] / a[c][c];
+          for (int k = c; k < n; k++)
+            a[r][k] -= f * a[c][k];
+          b[r] -= f * b[c];
+        }
+    }
+  for (int c = n-1; c >= 0; c--)
+    {
+      for (int k = c+1; k < n; k++)
+        b[c] -= a[c][k] * b[k];
+      b[c] /= a[c][c];
+    }
+  return true;
+}
+
+// whether p is inside the convex quad q, in either winding
+static bool inQuad(const cv::Point2f q[4], double x, double y)
+{
+  int pos = 0, neg = 0;
+  for (int i = 0; i < 4; i++)
+    {
+      const cv::Point2f &a = q[i], &b = q[(i+1)%4];
+      double cross = (b.x - a.x) * (y - a.y) - (b.y - a.y) * (x - a.x);
+      if (cross > 0) pos++;
+      if (cross < 0) neg++;
+    }
+  return pos == 0 || neg == 0;
+}
+
+bool ViewScorer::measure(const std::vector<cv::Point2f> &corners, BoardView &view) const
+{
+  int cols = pattern_.width, rows = pattern_.height;
+  if ((int)corners.size() != cols * rows || cols < 2 || rows < 2)
+    return false;
+
+  // the outer corners, and where they are on the board, in squares
+  cv::Point2f quad[4] = { corners[0], corners[cols-1], corners[cols*rows-1], corners[cols*(rows-1)] };
+  double w = cols - 1, h = rows - 1;
+  double board[4][2] = { {0, 0}, {w, 0}, {w, h}, {0, h} };
+
+  // Homography from the board to normalized image coordinates, with the
+  // principal point at the center.  Its columns are then the board's
+  // x and y axes and origin in the camera frame, up to scale.
+  double a[8][8], m[9];
+  for (int i = 0; i < 4; i++)
+    {
+      double X = board[i][0], Y = board[i][1];
+      double u = (quad[i].x - image_.width/2.0) / focal_;
+      double v = (quad[i].y - image_.height/2.0) / focal_;
+      double r0[8] = { X, Y, 1, 0, 0, 0, -u*X, -u*Y };
+      double r1[8] = { 0, 0, 0, X, Y, 1, -v*X, -v*Y };
+      std::copy(r0, r0+8, a[2*i]);
+      std::copy(r1, r1+8, a[2*i+1]);
+      m[2*i] = u;
+      m[2*i+1] = v;
+    }
+  if (!solve(a, m, 8))
+    return false;
+  m[8] = 1;
+
+  double n1 = sqrt(m[0]*m[0] + m[3]*m[3] + m[6]*m[6]);
+  double n2 = sqrt(m[1]*m[1] + m[4]*m[4] + m[7]*m[7]);
+  if (n1 < 1e-12 || n2 < 1e-12)
+    return false;
+  double scale = 2.0 / (n1 + n2);
+  if (m[8] * scale < 0)         // the board is in front of the camera
+    scale = -scale;
+  double r1[3] = { m[0]*scale, m[3]*scale, m[6]*scale };
+  double r2[3] = { m[1]*scale, m[4]*scale, m[7]*scale };
+  double t[3];                  // the middle of the board
+  for (int i = 0; i < 3; i++)
+    t[i] = m[3*i+2]*scale + r1[i]*w/2 + r2[i]*h/2;
+
+  double n[3] = { r1[1]*r2[2] - r1[2]*r2[1], r1[2]*r2[0] - r1[0]*r2[2], r1[0]*r2[1] - r1[1]*r2[0] };
+  double nn = sqrt(n[0]*n[0] + n[1]*n[1] + n[2]*n[2]);
+  if (nn < 1e-12)
+    return false;
+  for (int i = 0; i < 3; i++)
+    view.normal[i] = n[i] / nn;
+  view.distance = sqrt(t[0]*t[0] + t[1]*t[1] + t[2]*t[2]);
+  view.tilt = acos(std::min(1.0, fabs(view.normal[2])));
+
+  double cx = 0, cy = 0;
+  for (size_t i = 0; i < corners.size(); i++)
+    {
+      cx += corners[i].x;
+      cy += corners[i].y;
+    }
+  view.center[0] = cx / corners.size() / image_.width;
+  view.center[1] = cy / corners.size() / image_.width;
+
+  view.cells.clear();
+  for (int r = 0; r < grid_rows_; r++)
+    for (int c = 0; c < grid_cols_; c++)
+      if (inQuad(quad, (c + 0.5) * image_.width / grid_cols_, (r + 0.5) * image_.height / grid_rows_))
+        view.cells.push_back(r * grid_cols_ + c);
+
+  view.sharpness = 0;
+  return true;
+}
+
+double ViewScorer::novelty(const BoardView &view) const
+{
+  int gain = 0;
+  for (size_t i = 0; i < view.cells.size(); i++)
+    if (covered_[view.cells[i]] == 0)
+      gain++;
+  double score = (double)gain / MIN_NEW_CELLS;
+
+  double nearest = views_.empty() ? 1e6 : HUGE_VAL;
+  for (size_t i = 0; i < views_.size(); i++)
+    {
+      const BoardView &s = views_[i];
+      double dot = view.normal[0]*s.normal[0] + view.normal[1]*s.normal[1] + view.normal[2]*s.normal[2];
+      double da = acos(std::max(-1.0, std::min(1.0, dot))) / ANGLE_STEP;
+      double dd = fabs(log(view.distance / s.distance)) / log(DISTANCE_STEP);
+      double dx = view.center[0] - s.center[0], dy = view.center[1] - s.center[1];
+      double dc = sqrt(dx*dx + dy*dy) / CENTER_STEP;
+      nearest = std::min(nearest, sqrt(da*da + dd*dd + dc*dc));
+    }
+  return std::max(score, nearest);
+}
+
+double ViewScorer::sharpness(const cv::Mat &gray, const std::vector<cv::Point2f> &corners)
+{
+  if (corners.empty())
+    return 0;
+  float x0 = corners[0].x, x1 = x0, y0 = corners[0].y, y1 = y0;
+  for (size_t i = 1; i < corners.size(); i++)
+    {
+      x0 = std::min(x0, corners[i].x);
+      x1 = std::max(x1, corners[i].x);
+      y0 = std::min(y0, corners[i].y);
+      y1 = std::max(y1, corners[i].y);
+    }
+  int c0 = std::max(1, (int)x0), c1 = std::min(gray.cols - 2, (int)x1);
+  int r0 = std::max(1, (int)y0), r1 = std::min(gray.rows - 2, (int)y1);
+
+  // 4-neighbour Laplacian, straight off the rows
+  double sl = 0, sll = 0, sp = 0, spp = 0;
+  long n = 0;
+  for (int r = r0; r <= r1; r++)
+    {
+      const uint8_t *up = gray.ptr<uint8_t>(r-1);
+      const uint8_t *row = gray.ptr<uint8_t>(r);
+      const uint8_t *down = gray.ptr<uint8_t>(r+1);
+      for (int c = c0; c <= c1; c++)
+        {
+          int p = row[c];
+          int l = 4*p - up[c] - down[c] - row[c-1] - row[c+1];
+          sl += l;
+          sll += (double)l*l;
+          sp += p;
+          spp += (double)p*p;
+        }
+      n += c1 - c0 + 1;
+    }
+  if (n < 2)
+    return 0;
+  double var_l = sll/n - (sl/n)*(sl/n);
+  double var_p = spp/n - (sp/n)*(sp/n);
+  return var_p > 0 ? sqrt(var_l / var_p) : 0;
+}
+
+bool ViewScorer::sharpEnough(double sharpness) const
+{
+  std::vector<double> s;
+  for (size_t i = 0; i < views_.size(); i++)
+    if (views_[i].sharpness > 0)
+      s.push_back(views_[i].sharpness);
+  if (s.empty())
+    return true;
+  std::nth_element(s.begin(), s.begin() + s.size()/2, s.end());
+  return sharpness >= SHARP_FRACTION * s[s.size()/2];
+}
+
+void ViewScorer::add(const BoardView &view)
+{
+  views_.push_back(view);
+  for (size_t i = 0; i < view.cells.size(); i++)
+    covered_[view.cells[i]]++;
+}
+
+double ViewScorer::coverage() const
+{
+  int n = 0;
+  for (size_t i = 0; i < covered_.size(); i++)
+    if (covered_[i] > 0)
+      n++;
+  return (double)n / covered_.size();
+}
+
+} // namespace kinect_calibration
@@ -36,7 +36,10 @@
 #include <boost/thread/thread.hpp>
 #include <boost/thread/mutex.hpp>
 #include <boost/thread/condition.hpp>
+#include <boost/bind.hpp>
 #include <Eigen3/StdVector>
+#include <algorithm>
+#include <sstream>
 
 
 #include <ros/ros.h>
@@ -61,6 +64,7 @@
 
 #include <pcl/filters/extract_indices.h>
 #include <pcl/filters/passthrough.h>
+#include <pcl/filters/voxel_grid.h>
 
 #include <pcl/sample_consensus/method_types.h>
 #include <pcl/sample_consensus/model_types.h>
@@ -68,6 +72,13 @@
 
 #include <body_msgs/Hands.h>
 
+#include <rosbag/bag.h>
+#include <rosbag/view.h>
+#include <boost/foreach.hpp>
+#include <deque>
+#include <dirent.h>
+#include <unistd.h>
+
 
 float gdist(pcl::PointXYZ pt, const Eigen3::Vector4f &v){
    return sqrt((pt.x-v(0))*(pt.x-v(0))+(pt.y-v(1))*(pt.y-v(1))+(pt.z-v(2))*(pt.z-v(2))); //
@@ -115,6 +126,7 @@ public:
    Eigen3::Vector4f centroid, direction;
    Finger(pcl::PointCloud<pcl::PointXYZ> &cluster, Eigen3::Vector4f &palmcenter){
       cloud=cluster;
+      fname=handdetector::UNKNOWN;
       EIGEN_ALIGN16 Eigen3::Vector3f eigen_values;
       EIGEN_ALIGN16 Eigen3::Matrix3f eigen_vectors;
       Eigen3::Matrix3f cov;
@@ -149,7 +161,15 @@ public:
     body_msgs::Hand handmsg;
     double distfromsensor;
     Eigen3::Vector4f centroid,arm;
+    Eigen3::Vector3f shape; //eigenvalues of the whole hand cloud, smallest first
     int thumb;
+    bool verbose; //collect the per-hand stats in stats, to be printed by whoever runs us
+    std::string stats;
+    int maxpoints;  //latency budget: if >0, full is downsampled to about this many points before processing
+    double leafsize; //voxel size full was downsampled with, 0 if it was left alone
+    double density;  //fraction of the points that survived downsampling
+
+    HandProcessor():verbose(true),maxpoints(0),leafsize(0),density(1.0){}
 
 //    HandProcessor(pcl::PointCloud<pcl::PointXYZ> &cloud){
 //       full=cloud;
@@ -169,6 +189,10 @@ public:
         handmsg.stamp=cloud.header.stamp;
         digits=pcl::PointCloud<pcl::PointXYZ>();
         palm=pcl::PointCloud<pcl::PointXYZ>();
+        fingers.clear();
+        stats.clear();
+        leafsize=0;
+        density=1.0;
         arm=_arm;
         handmsg.arm=eigenToMsgPoint(arm);
 
@@ -182,11 +206,36 @@ public:
         distfromsensor=centroid.norm();  //because we are in the sensor's frame
         digits=pcl::PointCloud<pcl::PointXYZ>();
         palm=pcl::PointCloud<pcl::PointXYZ>();
+        fingers.clear();
+        stats.clear();
+        thumb=-1;
+        leafsize=0;
+        density=1.0;
         arm(0)=handmsg.arm.x;
         arm(1)=handmsg.arm.y;
         arm(2)=handmsg.arm.z;
     }
 
+    //////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+    /** \brief voxel-downsamples full to about maxpoints points, so the time spent on a hand does not depend on how close it is.
+     * The kinect's points are about distfromsensor/580 apart, so a voxel that is sqrt(n/maxpoints) times that spacing
+     * leaves about maxpoints points.  density records how many points we kept, so the thresholds can be scaled to match.
+      * \param maxpoints the number of points we are aiming for
+      */
+    void downsample(int maxpoints){
+      int n=full.points.size();
+      if(maxpoints<=0 || n<=maxpoints) return;
+      double spacing=distfromsensor/580.0;
+      leafsize=spacing*sqrt((double)n/maxpoints);
+      pcl::PointCloud<pcl::PointXYZ> out;
+      pcl::VoxelGrid<pcl::PointXYZ> grid;
+      grid.setInputCloud(full.makeShared());
+      grid.setLeafSize(leafsize,leafsize,leafsize);
+      grid.filter(out);
+      density=(double)out.points.size()/n;
+      full=out;
+    }
+
     //
     //////////////////////////////////////////////////////////////////////////////////////////////////////////////////
     /** \brief filter the fingers from the palm.  This is done by performing radius searches to determine the point density.
@@ -230,10 +279,11 @@ public:
         if(inds2[i]==0) continue;
           sc2.NNN(full.points[i],searchinds,tol);
           //TODO: this is good for face-on, but not great for tilted hands
-          if(searchinds.size()>(530-500*distfromsensor)){
+          //the thresholds are for the full resolution cloud, so scale them if we downsampled
+          if(searchinds.size()>(530-500*distfromsensor)*density){
              inds.push_back(i);
 
-             if(searchinds.size()>(570-500*distfromsensor))
+             if(searchinds.size()>(570-500*distfromsensor)*density)
                 label=0;
              else
                 label=1;
@@ -254,7 +304,11 @@ public:
 
       t3=g_tock(t0);
 //    printf("radius: %05d %.03f, %.03f, %.03f   ",full.points.size(),t1,t2,t3);
-       std::cout<<"dist:  "<<distfromsensor<<"  palm: "<<palm.points.size()<<"  digits: "<<digits.points.size()<<" "<<(575-500*distfromsensor)<<std::endl;
+       if(verbose){
+         std::ostringstream out;
+         out<<"dist:  "<<distfromsensor<<"  palm: "<<palm.points.size()<<"  digits: "<<digits.points.size()<<" "<<(575-500*distfromsensor)<<std::endl;
+         stats+=out.str();
+       }
     }
 
     sensor_msgs::PointCloud2 getPalm(){
@@ -364,17 +418,42 @@ public:
 
     }
 
+    //////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+    /** \brief finds the spread of the whole hand cloud. the ratio of the two largest values tells us how flat the hand is
+      */
+    void getShape(){
+      EIGEN_ALIGN16 Eigen3::Matrix3f eigen_vectors;
+      Eigen3::Matrix3f cov;
+      shape.setZero();
+      if(!full.points.size()) return;
+      pcl::computeCovarianceMatrixNormalized(full,centroid,cov);
+      pcl::eigen33 (cov, eigen_vectors, shape);
+    }
+
     //////////////////////////////////////////////////////////////////////////////////////////////////////////////////
     /** \brief The method to rule them all: when processing a hand, just call this function.
       */
     void Process(){
       timeval t0=g_tick();
       double t1,t2,t3;
+      downsample(maxpoints);
+      if(verbose && leafsize>0){
+         std::ostringstream out;
+         out<<"downsampled to "<<full.points.size()<<" points, voxel size "<<leafsize<<std::endl;
+         stats+=out.str();
+      }
       radiusFilter(300,.02);
       t1=g_tock(t0);t0=g_tick();
-      segFingers();
+      if(leafsize>0){
+         //keep the cluster tolerance the same number of point spacings, and the smallest finger the same size
+         double spacing=distfromsensor/580.0;
+         segFingers(.005*std::max(1.0,leafsize/spacing),std::max(1,(int)(50*density)));
+      }
+      else
+         segFingers();
       t2=g_tock(t0);t0=g_tick();
        identfyFingers();
+       getShape();
       t3=g_tock(t0);
 //    printf("process: %.03f, %.03f, %.03f",t1,t2,t3);
 //    std::cout<<"process: "<<setw(6)<<t1<<setw(6)<<",  "<<t2<<",  "<<t3;
@@ -384,6 +463,200 @@ public:
 };
 
 
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+/** \brief @b HandTracker follows one hand from frame to frame.  It keeps the finger names the same between frames,
+ * and turns the per-frame finger count and hand shape into a gesture state that does not flicker.
+ * Everything here works on at most five fingers, so it takes a few microseconds no matter what the clouds look like.
+ */
+class HandTracker{
+public:
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+   Eigen3::Vector4f lastfinger[5]; //where each named finger was last seen, relative to the palm
+   int missed[5];                   //frames since each finger was seen, -1 if we have never seen it
+   Eigen3::Vector4f palm;           //where the palm was last seen
+   int lost;                        //frames since the hand was seen
+   int seq;                         //id of the hand, changes when we lose the hand
+   std::string state;               //current gesture
+   std::string candidate;           //gesture we might switch to
+   int candidatecount;              //how many frames in a row we have seen the candidate
+
+   double gate;                     //max distance a finger can move between frames and keep its name
+   int maxmissed;                   //frames before we forget a finger, or a hand
+   int holdframes;                  //frames a new gesture must be seen for before we switch to it
+
+   HandTracker(){
+      gate=.03;
+      maxmissed=10;
+      holdframes=3;
+      seq=0;
+      lost=maxmissed+1;
+      Reset();
+   }
+
+   bool Active(){ return lost <= maxmissed; }
+
+   void Reset(){
+      for(int i=0;i<5;++i) missed[i]=-1;
+      state="unprocessed";
+      candidate=state;
+      candidatecount=0;
+   }
+
+   //call when the hand was not in this frame
+   void Missed(){
+      if(lost>maxmissed) return;
+      lost++;
+      if(lost==maxmissed+1)
+         Reset();
+   }
+
+   //////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+   /** \brief names the fingers in hp, reorders hp.handmsg.fingers by name (thumb first) and sets the gesture state
+     * \param newseq the seq to use if this is a new hand
+     * \return true if this is a new hand, and newseq was used
+     */
+   bool Update(HandProcessor &hp, int newseq){
+      bool newhand=!Active();
+      if(newhand){
+         Reset();
+         seq=newseq;
+      }
+      lost=0;
+      palm=hp.centroid;
+      nameFingers(hp);
+      for(int i=0;i<5;++i)
+         if(missed[i]>=0 && ++missed[i] > maxmissed) missed[i]=-1;
+      for(uint i=0;i<hp.fingers.size();++i)
+         if(hp.fingers[i].fname!=handdetector::UNKNOWN){
+            lastfinger[hp.fingers[i].fname]=hp.fingers[i].centroid-hp.centroid;
+            missed[hp.fingers[i].fname]=0;
+         }
+
+      //rewrite the finger list in name order, so the thumb is always first if we have one
+      hp.handmsg.fingers.clear();
+      hp.handmsg.thumb=-1;
+      for(int n=handdetector::THUMB;n<=handdetector::UNKNOWN;++n)
+         for(uint i=0;i<hp.fingers.size();++i)
+            if(hp.fingers[i].fname==n){
+               if(n==handdetector::THUMB) hp.handmsg.thumb=hp.handmsg.fingers.size();
+               hp.handmsg.fingers.push_back(eigenToMsgPoint(hp.fingers[i].centroid));
+            }
+      hp.thumb=hp.handmsg.thumb;
+      hp.handmsg.seq=seq;
+      updateGesture(hp);
+      hp.handmsg.state=state;
+      return newhand;
+   }
+
+private:
+
+   //////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+   /** \brief gives each finger a name.  Fingers close to where a named finger was last time keep that name.
+     * If we have no history, the thumb comes from HandProcessor::identfyFingers and the rest are named in order of
+     * distance from the thumb.  Only the five biggest clusters get names.
+     */
+   void nameFingers(HandProcessor &hp){
+      std::vector<int> cands; //indices of the fingers that we will try to name, biggest first
+      for(uint i=0;i<hp.fingers.size();++i){
+         hp.fingers[i].fname=handdetector::UNKNOWN;
+         cands.push_back(i);
+      }
+      for(uint i=0;i<cands.size();++i)
+         for(uint j=i+1;j<cands.size();++j)
+            if(hp.fingers[cands[j]].cloud.points.size() > hp.fingers[cands[i]].cloud.points.size())
+               std::swap(cands[i],cands[j]);
+      if(cands.size()>5) cands.resize(5);
+      if(!cands.size()) return;
+
+      bool history=false;
+      for(int n=0;n<5;++n) if(missed[n]>=0) history=true;
+
+      if(!history){
+         int thumb = hp.thumb>=0 ? hp.thumb : cands[0];
+         if(std::find(cands.begin(),cands.end(),thumb)==cands.end()) thumb=cands[0];
+         hp.fingers[thumb].fname=handdetector::THUMB;
+         std::vector<std::pair<double,int> > order;
+         for(uint i=0;i<cands.size();++i)
+            if(cands[i]!=thumb)
+               order.push_back(std::make_pair((hp.fingers[cands[i]].centroid-hp.fingers[thumb].centroid).norm(),cands[i]));
+         std::sort(order.begin(),order.end());
+         for(uint i=0;i<order.size();++i)
+            hp.fingers[order[i].second].fname=(handdetector::FingerName)(handdetector::INDEXF+i);
+         return;
+      }
+
+      //greedy assignment: take the closest (finger, name) pair, remove both, repeat
+      std::vector<std::pair<double,std::pair<int,int> > > pairs;
+      for(uint i=0;i<cands.size();++i)
+         for(int n=0;n<5;++n){
+            if(missed[n]<0) continue;
+            double d=(hp.fingers[cands[i]].centroid-hp.centroid-lastfinger[n]).norm();
+            if(d<gate)
+               pairs.push_back(std::make_pair(d,std::make_pair(cands[i],n)));
+         }
+      std::sort(pairs.begin(),pairs.end());
+      bool taken[5]={false,false,false,false,false};
+      for(uint i=0;i<pairs.size();++i){
+         int f=pairs[i].second.first, n=pairs[i].second.second;
+         if(taken[n] || hp.fingers[f].fname!=handdetector::UNKNOWN) continue;
+         hp.fingers[f].fname=(handdetector::FingerName)n;
+         taken[n]=true;
+      }
+
+      //anything left over gets the free name that was closest last time, or the first free name we never saw
+      for(uint i=0;i<cands.size();++i){
+         Finger &f=hp.fingers[cands[i]];
+         if(f.fname!=handdetector::UNKNOWN) continue;
+         int best=-1; double bestdist=0;
+         for(int n=0;n<5;++n){
+            if(taken[n] || missed[n]<0) continue;
+            double d=(f.centroid-hp.centroid-lastfinger[n]).norm();
+            if(best==-1 || d<bestdist){ best=n; bestdist=d; }
+         }
+         for(int n=0;n<5 && best==-1;++n)
+            if(!taken[n]) best=n;
+         if(best==-1) break;
+         f.fname=(handdetector::FingerName)best;
+         taken[best]=true;
+      }
+   }
+
+   //////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+   /** \brief picks the gesture for this frame, then only switches to it once it has been seen holdframes times in a row.
+     * The flatness threshold depends on the current state, so a hand sitting right at the threshold does not flicker.
+     */
+   void updateGesture(HandProcessor &hp){
+      int nfingers=hp.fingers.size();
+      //ratio of the two biggest eigenvalues: small means the hand is a long blob, big means it is a flat paddle
+      double flat = hp.shape(2)>0 ? hp.shape(1)/hp.shape(2) : 0.0;
+      double flatthresh = (state=="fist" || state=="grip") ? .45 : .35;
+      std::string g;
+      if(nfingers>=4)
+         g="open";
+      else if(flat>=flatthresh && nfingers<=2)
+         g="paddle";   //fingers together, so they don't separate into clusters
+      else if(nfingers<=1)
+         g="fist";
+      else
+         g="grip";
+
+      if(g==state){
+         candidatecount=0;
+         return;
+      }
+      if(g==candidate)
+         candidatecount++;
+      else{
+         candidate=g;
+         candidatecount=1;
+      }
+      if(candidatecount>=holdframes || state=="unprocessed"){
+         state=g;
+         candidatecount=0;
+      }
+   }
+};
+
 
 class HandAnalyzer
 {
@@ -392,7 +665,25 @@ private:
   ros::NodeHandle n_;
   ros::Publisher cloudpub_[2],cloudpub2_[2],pmappub_,handspub_;
   ros::Subscriber sub_;
+  ros::Timer paramtimer_;
   mapping_msgs::PolygonalMap pmap;
+  //how much debugging output to produce:
+  // 0: nothing but hands_pros  1: finger_norms  2: palm and digit clouds  3: per-hand stats on stdout
+  // 4: per-frame timing on stdout
+  int verbosity_;
+  int maxpoints_; //latency budget, see HandProcessor::downsample
+  std::vector<HandProcessor,Eigen3::aligned_allocator<HandProcessor> > procs_; //one result slot per hand
+  std::vector<HandTracker,Eigen3::aligned_allocator<HandTracker> > trackers_;
+  int nextseq_;
+
+  //the workers stay around between frames.  handscb hands them a frame through work_, and they and the
+  //callback thread each take the next unclaimed hand until there are none left
+  boost::thread_group workers_;
+  boost::mutex workmutex_;
+  boost::condition workready_,workdone_;
+  const body_msgs::Hands *work_;  //the frame being processed, NULL between frames
+  uint nexthand_,handsleft_;      //next hand to claim, and hands not finished yet
+  bool stopping_;
 
 public:
 
@@ -405,6 +696,46 @@ public:
    cloudpub2_[0] = n_.advertise<sensor_msgs::PointCloud2> ("hand0_cloud2", 1);
    cloudpub2_[1] = n_.advertise<sensor_msgs::PointCloud2> ("hand1_cloud2", 1);
     sub_=n_.subscribe("/hands", 1, &HandAnalyzer::handscb, this);
+    verbosity_=3;
+    maxpoints_=0;
+    nextseq_=0;
+    work_=NULL;
+    nexthand_=handsleft_=0;
+    stopping_=false;
+    //one worker fewer than the cores, because the callback thread works too
+    int nthreads=boost::thread::hardware_concurrency()-1;
+    for(int i=0;i<std::max(nthreads,1);i++)
+       workers_.create_thread(boost::bind(&HandAnalyzer::work,this));
+    readParams();
+    //the verbosity can be changed while we are running, but we don't want to hit the parameter server every frame
+    paramtimer_=n_.createTimer(ros::Duration(1.0), &HandAnalyzer::paramcb, this);
+  }
+
+  //////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+  /** \brief reads ~verbosity and ~production.  production mode turns off all the debugging output, regardless of verbosity.
+    * Also reads ~max_points, the latency budget: hands with more points than this are downsampled. 0 turns it off.
+    */
+  void readParams(){
+     ros::NodeHandle nh("~");
+     bool production;
+     nh.param("verbosity",verbosity_,verbosity_);
+     nh.param("max_points",maxpoints_,maxpoints_);
+     nh.param("production",production,false);
+     if(production)
+        verbosity_=0;
+  }
+
+  ~HandAnalyzer(){
+     {
+        boost::mutex::scoped_lock lock(workmutex_);
+        stopping_=true;
+     }
+     workready_.notify_all();
+     workers_.join_all();
+  }
+
+  void paramcb(const ros::TimerEvent &e){
+     readParams();
   }
 
 
@@ -442,21 +773,52 @@ public:
        pmap.header=h.handcloud.header;
   }
 
-  void ProcessHand(body_msgs::Hand &hand){
-     HandProcessor hp;
-     hp.Init(hand);
-     hp.Process();
+  //////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+  /** \brief runs the finger finding on one hand.  This only touches the HandProcessor it is given,
+    * so it is safe to run one of these per hand in parallel.
+    */
+  static void ProcessHand(HandProcessor *hp, const body_msgs::Hand *hand){
+     hp->Init(*hand);
+     hp->Process();
+  }
 
-//     hp.radiusFilter(300,.02);
-     hp.addFingerDirs(pmap);
-     if(hand.left){
-        cloudpub_[0].publish(hp.getPalm());
-        cloudpub2_[0].publish(hp.getDigits());
+  //////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+  /** \brief processes unclaimed hands of the current frame until there are none left.  Called with workmutex_ held,
+    * from the workers and from the callback thread.
+    */
+  void claimHands(boost::mutex::scoped_lock &lock){
+     while(work_ && nexthand_<work_->hands.size()){
+        uint i=nexthand_++;
+        lock.unlock();
+        ProcessHand(&procs_[i],&work_->hands[i]);
+        lock.lock();
+        if(--handsleft_==0)
+           workdone_.notify_all();
      }
-     else{
-        cloudpub_[1].publish(hp.getPalm());
-        cloudpub2_[1].publish(hp.getDigits());
+  }
+
+  void work(){
+     boost::mutex::scoped_lock lock(workmutex_);
+     while(!stopping_){
+        claimHands(lock);
+        workready_.wait(lock);
      }
+  }
+
+  //////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+  /** \brief collects the results of a processed hand. This publishes, so it is only called from the callback thread,
+    * one hand at a time, in the order the hands came in.
+    */
+  void MergeHand(HandProcessor &hp, body_msgs::Hand &hand){
+//     hp.radiusFilter(300,.02);
+     if(verbosity_>=1 && pmappub_.getNumSubscribers())
+        hp.addFingerDirs(pmap);
+     //only serialize the debug clouds if someone is listening
+     int side = hand.left ? 0 : 1;
+     if(verbosity_>=2 && cloudpub_[side].getNumSubscribers())
+        cloudpub_[side].publish(hp.getPalm());
+     if(verbosity_>=2 && cloudpub2_[side].getNumSubscribers())
+        cloudpub2_[side].publish(hp.getDigits());
      //update the original message:
      hand=hp.handmsg;
      pmap.header=hand.handcloud.header;
@@ -465,21 +827,79 @@ public:
 
 
 
+  //////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+  /** \brief matches the processed hands to the trackers by palm position, and updates the trackers.
+    */
+  void trackHands(){
+     timeval t0=g_tick();
+     std::vector<bool> used(trackers_.size(),false);
+     for(uint i=0;i<procs_.size();i++){
+        int best=-1; double bestdist=.15;  //a hand more than 15cm from where it was is a new hand
+        for(uint j=0;j<trackers_.size();j++){
+           if(used[j] || !trackers_[j].Active()) continue;
+           double d=(trackers_[j].palm-procs_[i].centroid).norm();
+           if(d<bestdist){ best=j; bestdist=d; }
+        }
+        for(uint j=0;j<trackers_.size() && best==-1;j++)
+           if(!used[j] && !trackers_[j].Active()) best=j;
+        if(best==-1){
+           trackers_.push_back(HandTracker());
+           used.push_back(false);
+           best=trackers_.size()-1;
+        }
+        used[best]=true;
+        if(trackers_[best].Update(procs_[i],nextseq_))
+           nextseq_++;
+     }
+     for(uint j=0;j<trackers_.size();j++)
+        if(!used[j]) trackers_[j].Missed();
+     if(verbosity_>=4)
+        std::cout<<"tracking: "<<g_tock(t0)<<std::endl;
+  }
+
   void handscb(const body_msgs::HandsConstPtr &hands){
      body_msgs::Hands handsout=*hands;
      pmap.polygons.clear();
      pmap.header=hands->header;
+     if(hands->hands.size())
+        handsout.header=hands->hands[0].handcloud.header;
+
+     //each hand gets its own processor, so the hands can be worked on at the same time.
+     //the workers and this thread share them out, and this thread waits for the last one
+     procs_.resize(hands->hands.size());
+     for(uint i=0;i<procs_.size();i++){
+        procs_[i].verbose = verbosity_>=3;
+        procs_[i].maxpoints = maxpoints_;
+     }
+     if(hands->hands.size()){
+        boost::mutex::scoped_lock lock(workmutex_);
+        work_=hands.get();
+        nexthand_=0;
+        handsleft_=hands->hands.size();
+        if(handsleft_>1)
+           workready_.notify_all();
+        claimHands(lock);
+        while(handsleft_>0)
+           workdone_.wait(lock);
+        work_=NULL;
+     }
+     //the stats were collected on whichever thread did the hand, so they are printed here, in order
+     for(uint i=0;i<procs_.size();i++)
+        std::cout<<procs_[i].stats;
+
+     trackHands();
+
+     //merge in order, so the output does not depend on which thread finished first
      for(uint i=0;i<hands->hands.size();i++){
 //        getEigens(hands->hands[i]);
 //        if(hands->hands[i].left)
 //           cloudpub_[0].publish(hands->hands[i].handcloud);
 //        else
 //           cloudpub_[1].publish(hands->hands[i].handcloud);
-        ProcessHand(handsout.hands[i]);
-        handsout.header=hands->hands[0].handcloud.header;
-
+        MergeHand(procs_[i],handsout.hands[i]);
      }
-     pmappub_.publish(pmap);
+     if(verbosity_>=1 && pmappub_.getNumSubscribers())
+        pmappub_.publish(pmap);
      handspub_.publish(handsout);
   }
 
@@ -487,9 +907,259 @@ public:
 
 
 
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+/** \brief @b HandBatch runs HandProcessor over recorded hands, as fast as the machine allows.
+ * The hands are read on the main thread and handed to one worker per core. Each frame gets a slot for its results,
+ * and the results are written out in frame order once everything is done, one row per hand, tab separated.
+ */
+class HandBatch{
+   //one unit of work: all the hands from one frame
+   struct Frame{
+      int index;
+      std::string source;
+      std::vector<body_msgs::Hand> hands;
+   };
+   //what we keep from each hand
+   struct Result{
+      std::string source;
+      double stamp;
+      int npoints;
+      double dist;
+      double resolution;
+      int thumb;
+      std::vector<geometry_msgs::Point> fingers;
+      double time;
+   };
+
+   std::deque<Frame> queue;
+   boost::mutex mutex;
+   boost::condition notempty,notfull;
+   bool done;
+   uint maxqueue;
+   std::vector<std::vector<Result> > results;
+
+public:
+   int maxpoints; //latency budget handed to HandProcessor, 0 for none
+
+   HandBatch(){
+      done=false;
+      maxqueue=64;
+      maxpoints=0;
+   }
+
+   //////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+   /** \brief processes everything in input and writes the results to output.
+     * \param input either a bag file with body_msgs/Hands on topic, or a directory of pcd files.
+     *  For the pcd files, each foo.pcd needs a foo.arm with the x y z of the arm point.
+     * \param nthreads number of workers, 0 to use one per core
+     */
+   int Run(const std::string &input, const std::string &output, const std::string &topic, int nthreads){
+      if(nthreads<=0) nthreads=boost::thread::hardware_concurrency();
+      if(nthreads<=0) nthreads=1;
+      FILE *f=fopen(output.c_str(),"w");
+      if(!f){
+         printf("Could not open %s for writing\n",output.c_str());
+         return 1;
+      }
+
+      timeval t0=g_tick();
+      boost::thread_group workers;
+      for(int i=0;i<nthreads;i++)
+         workers.create_thread(boost::bind(&HandBatch::work,this));
+
+      int nframes;
+      DIR *dir=opendir(input.c_str());
+      if(dir)
+         nframes=readPcds(dir,input);
+      else
+         nframes=readBag(input,topic);
+
+      {
+         boost::mutex::scoped_lock lock(mutex);
+         done=true;
+      }
+      notempty.notify_all();
+      workers.join_all();
+      double elapsed=g_tock(t0);
+
+      if(nframes==0)
+         printf("No frames found in %s\n",input.c_str());
+      if(nframes<=0){
+         fclose(f);
+         unlink(output.c_str());
+         return 1;
+      }
+      int nhands=write(f);
+      fclose(f);
+      printf("Processed %d hands in %d frames with %d threads in %.2f s, wrote %s\n",
+             nhands,nframes,nthreads,elapsed,output.c_str());
+      return 0;
+   }
+
+private:
+
+   void push(Frame &frame){
+      boost::mutex::scoped_lock lock(mutex);
+      while(queue.size()>=maxqueue)
+         notfull.wait(lock);
+      if(results.size()<=(uint)frame.index)
+         results.resize(frame.index+1);
+      queue.push_back(frame);
+      notempty.notify_one();
+   }
+
+   int readBag(const std::string &file, const std::string &topic){
+      rosbag::Bag bag;
+      try{
+         bag.open(file,rosbag::bagmode::Read);
+      }
+      catch(rosbag::BagException &e){
+         printf("Could not open %s: %s\n",file.c_str(),e.what());
+         return -1;
+      }
+      std::vector<std::string> topics(1,topic);
+      rosbag::View view(bag,rosbag::TopicQuery(topics));
+      int count=0,skipped=0;
+      std::string skiptype,skipmd5;
+      BOOST_FOREACH(rosbag::MessageInstance const m, view){
+         body_msgs::HandsConstPtr hands=m.instantiate<body_msgs::Hands>();
+         //a different type, or a different version of body_msgs/Hands
+         if(!hands){
+            if(!skipped++){
+               skiptype=m.getDataType();
+               skipmd5=m.getMD5Sum();
+            }
+            continue;
+         }
+         Frame frame;
+         frame.index=count++;
+         frame.source=file;
+         frame.hands=hands->hands;
+         push(frame);
+      }
+      bag.close();
+      if(skipped)
+         printf("WARNING: skipped %d messages on %s that are not body_msgs/Hands %s; the first was %s %s\n",
+                skipped,topic.c_str(),ros::message_traits::MD5Sum<body_msgs::Hands>::value(),
+                skiptype.c_str(),skipmd5.c_str());
+      return count;
+   }
+
+   int readPcds(DIR *dir, const std::string &path){
+      std::vector<std::string> names;
+      struct dirent *ent;
+      while((ent=readdir(dir))!=NULL){
+         std::string name(ent->d_name);
+         if(name.size()>4 && name.substr(name.size()-4)==".pcd")
+            names.push_back(name);
+      }
+      closedir(dir);
+      std::sort(names.begin(),names.end());
+
+      int count=0;
+      for(uint i=0;i<names.size();i++){
+         std::string base=path+"/"+names[i].substr(0,names[i].size()-4);
+         double x,y,z;
+         FILE *af=fopen((base+".arm").c_str(),"r");
+         if(!af || fscanf(af,"%lf %lf %lf",&x,&y,&z)!=3){
+            printf("Skipping %s: no arm point in %s.arm\n",names[i].c_str(),base.c_str());
+            if(af) fclose(af);
+            continue;
+         }
+         fclose(af);
+         pcl::PointCloud<pcl::PointXYZ> cloud;
+         if(pcl::io::loadPCDFile(base+".pcd",cloud)<0){
+            printf("Skipping %s: could not read it\n",names[i].c_str());
+            continue;
+         }
+         Frame frame;
+         frame.index=count++;
+         frame.source=names[i];
+         frame.hands.resize(1);
+         body_msgs::Hand &hand=frame.hands[0];
+         hand.arm.x=x; hand.arm.y=y; hand.arm.z=z;
+         hand.thumb=-1;
+         pcl::toROSMsg(cloud,hand.handcloud);
+         push(frame);
+      }
+      return count;
+   }
+
+   void work(){
+      HandProcessor hp;
+      hp.verbose=false;
+      hp.maxpoints=maxpoints;
+      while(true){
+         Frame frame;
+         {
+            boost::mutex::scoped_lock lock(mutex);
+            while(queue.empty() && !done)
+               notempty.wait(lock);
+            if(queue.empty()) return;
+            frame=queue.front();
+            queue.pop_front();
+            notfull.notify_one();
+         }
+         std::vector<Result> res(frame.hands.size());
+         for(uint i=0;i<frame.hands.size();i++){
+            timeval t0=g_tick();
+            hp.Init(frame.hands[i]);
+            hp.Process();
+            res[i].time=g_tock(t0);
+            res[i].source=frame.source;
+            res[i].stamp=hp.handmsg.handcloud.header.stamp.toSec();
+            res[i].npoints=frame.hands[i].handcloud.width*frame.hands[i].handcloud.height;
+            res[i].dist=hp.distfromsensor;
+            res[i].resolution=hp.leafsize;
+            res[i].thumb=hp.handmsg.thumb;
+            res[i].fingers=hp.handmsg.fingers;
+         }
+         //results has been sized by push(), and every frame has its own slot
+         boost::mutex::scoped_lock lock(mutex);
+         results[frame.index].swap(res);
+      }
+   }
+
+   int write(FILE *f){
+      fprintf(f,"frame\thand\tsource\tstamp\tnpoints\tdist\tresolution\tnfingers\tthumb");
+      for(int j=0;j<5;j++)
+         fprintf(f,"\tf%d_x\tf%d_y\tf%d_z",j,j,j);
+      fprintf(f,"\tprocess_time\n");
+      int nhands=0;
+      for(uint i=0;i<results.size();i++)
+         for(uint h=0;h<results[i].size();h++,nhands++){
+            Result &r=results[i][h];
+            fprintf(f,"%d\t%d\t%s\t%.6f\t%d\t%.4f\t%.4f\t%d\t%d",i,h,r.source.c_str(),r.stamp,r.npoints,r.dist,r.resolution,(int)r.fingers.size(),r.thumb);
+            for(uint j=0;j<5;j++){
+               if(j<r.fingers.size())
+                  fprintf(f,"\t%.4f\t%.4f\t%.4f",r.fingers[j].x,r.fingers[j].y,r.fingers[j].z);
+               else
+                  fprintf(f,"\tnan\tnan\tnan");
+            }
+            fprintf(f,"\t%.6f\n",r.time);
+         }
+      return nhands;
+   }
+};
+
+
 
 int main(int argc, char **argv)
 {
+  //offline mode, does not need a ros master
+  if(argc>1 && std::string(argv[1])=="--batch"){
+    if(argc<4){
+      printf("Usage:\n"
+             "%s --batch <input.bag | pcd_dir> <output.tsv> [nthreads] [topic] [max_points]\n",argv[0]);
+      return 1;
+    }
+    ros::Time::init();
+    HandBatch batch;
+    if(argc>6)
+      batch.maxpoints=atoi(argv[6]);
+    return batch.Run(argv[2],argv[3],argc>5 ? argv[5] : "/hands",argc>4 ? atoi(argv[4]) : 0);
+  }
+
   ros::init(argc, argv, "hand_detector");
   ros::NodeHandle n;
   HandAnalyzer detector;